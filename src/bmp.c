@@ -1,3 +1,7 @@
+// mmap, fstat and friends
+#define _POSIX_C_SOURCE 200809L
+// syscall() for the io_uring ring
+#define _DEFAULT_SOURCE
 
 #include "bmp.h"
 
@@ -9,175 +13,476 @@
 #include <stdbool.h>
 #include <limits.h>
 
-struct {
-    uint32_t dummy;
-    uint16_t val;
-} endianness_test = { 0, 0xFF00 };
-
-bool fread_little_value(void* ptr, size_t size, size_t n, FILE* restrict f) {
-
-    uint8_t swap;
-    size_t num_read = fread(ptr, size, n, f);
-    if (num_read != n)
-        return false;
-    // possible alignment crash. used uintmax_t to try to guarantee it'd get placed in an acceptable spot
-    if (*(unsigned char*)&endianness_test.val) {
-        // big endian lands here
-        switch (size) {
-            case 2:
-                swap = *((uint8_t*)ptr + 1);
-                *((uint8_t*)ptr + 1) = *(uint8_t*)ptr;
-                *(uint8_t*)ptr = swap;
-                break;
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
-            case 4:
-                // outer
-                swap = *((uint8_t*)ptr + 3);
-                *((uint8_t*)ptr + 3) = *(uint8_t*)ptr;
-                *(uint8_t*)ptr = swap;
-                // inner
-                swap = *((uint8_t*)ptr + 2);
-                *((uint8_t*)ptr + 2) = *((uint8_t*)ptr + 1);
-                *((uint8_t*)ptr + 1) = swap;
-                break;
-            default:
-                assert((size == 2) || (size == 4));
-                return false;
-        }
-    }
-    return true;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+// SSE2 / AVX2 / AVX-512 kernels are compiled in regardless of -m flags and picked at runtime
+#define BMP_X86_DISPATCH
+#endif
+
+// NEON is part of every AArch64 cpu, its kernels need no runtime check
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BMP_NEON
+#endif
+
+// Batch reads go through a raw io_uring ring (no liburing needed); -DBMP_NO_IO_URING leaves
+//  only the pread fallback
+#if defined(__linux__) && !defined(BMP_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define BMP_IO_URING
+#endif
+#endif
+
+// Little endian loads from a byte buffer, safe on unaligned (mapped) data.
+//  Byte order is resolved at compile time; on little endian hosts these are plain loads.
+#if (defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)) \
+    || defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)
+static inline uint16_t load_little_u16(const unsigned char* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+static inline uint32_t load_little_u32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+#elif defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+static inline uint16_t load_little_u16(const unsigned char* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap16(v);
+}
+static inline uint32_t load_little_u32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap32(v);
+}
+#else
+static inline uint16_t load_little_u16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+static inline uint32_t load_little_u32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+#endif
+
+// Instruction set extensions a kernel needs, as cpu_isa() reports them
+#define ISA_SSE2        (1U << 0)
+#define ISA_SSSE3       (1U << 1)
+#define ISA_AVX2        (1U << 2)
+#define ISA_AVX512      (1U << 3)   // F and BW
+#define ISA_NEON        (1U << 4)
+
+// What the running cpu (and OS, for the AVX-512 register state) supports
+static unsigned cpu_isa(void) {
+    unsigned isa = 0;
+#ifdef BMP_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        isa |= ISA_SSE2;
+    if (__builtin_cpu_supports("ssse3"))
+        isa |= ISA_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        isa |= ISA_AVX2;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        isa |= ISA_AVX512;
+#endif
+#ifdef BMP_NEON
+    isa |= ISA_NEON;
+#endif
+    return isa;
 }
 
+static inline void store_little_u16(unsigned char* p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+static inline void store_little_u32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
 
-/*
-// bool x(template<t> buffer, FILE* value_in)
-// errno
-#define read_deserealize(BUFFER, FP) if (sizeof(*(BUFFER)) != fread((BUFFER), sizeof(*(BUFFER)), 1, (FP))) { return false;}
-// bool x(void* buffer, uint cb, uint count, FILE* array_in)
-// errno
-#define read_deserealize_blob(BUFFER, CB, FP) if ((CB) != fread((BUFFER), 1, (CB), (FP))) { return false; }
+// ===                              ===
+// ===          Allocation          ===
+// ===                              ===
 
-#define write_serialize(BUFFER, FP) if (sizeof(*(BUFFER)) != fwrite(BUFFER, sizeof(*(BUFFER)), 1, (FP))) { return false; }
+static void* default_alloc(void* user, size_t cb) {
+    return malloc(cb);
+}
 
-#define write_serialize_blob(BUFFER, CB, FP) if ((CB) != fwrite((BUFFER), 1, (CB), (FP))) { return false; }
+static void default_free(void* user, void* p) {
+    free(p);
+}
 
-// TODO big endianness support (bmps use little endian)
+const BMP_ALLOCATOR bmp_default_allocator = { default_alloc, default_free, NULL };
 
-//      DDB FILE:
-//
-//  //////////////////
-//  //  [0x0000]    //
-//  //  header      //
-//  //              //
-//  //////////////////
-//  //  system      //
-//  //  colormap    //
-//  //  index blob  //
-//  //////////////////
-//
-bool parse_bmp_v1(FILE* rfp, UNSERIAL_BITMAPV1* out) {
+static inline void* bmp_alloc(const BMP_ALLOCATOR* allocator, size_t cb) {
+    allocator = allocator ? allocator : &bmp_default_allocator;
+    return allocator->alloc(allocator->user, cb);
+}
 
-    errno = 0;
-    UNSERIAL_BITMAPV1FILEHEADER k = {0};
-    read_deserealize(&k.Type, rfp);
-    read_deserealize(&k.Width, rfp);
-    read_deserealize(&k.Height, rfp);
-    read_deserealize(&k.WidthCb, rfp);
-    read_deserealize(&k.Planes, rfp);
-    read_deserealize(&k.BitsPerPixel, rfp);
+static inline void bmp_free(const BMP_ALLOCATOR* allocator, void* p) {
+    allocator = allocator ? allocator : &bmp_default_allocator;
+    if (p)
+        allocator->release(allocator->user, p);
+}
 
-    if (DDB_TYPE_MAGIC != k.Type) {
-        fprintf(stderr, "\nCorrupted picture, .DDB->Magic was not equal to 0.");
-        errno = EINVAL;
-        return false;
+// Pool blocks carry their size class in front, so release needs no size
+typedef union POOL_BLOCK {
+    struct {
+        union POOL_BLOCK* next;     // while on a free list
+        unsigned size_class;
+    } hdr;
+    long double align;
+} POOL_BLOCK;
+
+// Four classes per power of two, so a block wastes at most a quarter of its size
+static size_t pool_capacity(unsigned size_class) {
+    if (!size_class)
+        return 64;
+    const unsigned e = 6 + (size_class - 1) / 4, m = (size_class - 1) % 4;
+    return (size_t)(4 + m + 1) << (e - 2);
+}
+
+static unsigned pool_class(size_t cb) {
+    if (cb <= 64)
+        return 0;
+    unsigned e = 0;     // floor(log2(cb - 1)), at least 6
+    for (size_t v = cb - 1; v >>= 1; )
+        ++e;
+    return 1 + (e - 6) * 4 + (unsigned)(((cb - 1) >> (e - 2)) & 3);
+}
+
+static void* pool_alloc(void* user, size_t cb) {
+
+    BMP_POOL* pool = user;
+    const unsigned size_class = pool_class(cb);
+    if (size_class >= BMP_POOL_CLASSES)
+        return NULL;
+    const size_t capacity = pool_capacity(size_class);
+    if (capacity > SIZE_MAX - sizeof(POOL_BLOCK))
+        return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    POOL_BLOCK* block = pool->free[size_class];
+    if (block) {
+        pool->free[size_class] = block->hdr.next;
+        pool->cached -= capacity;
     }
+    else ++pool->heap_allocs;
+    pthread_mutex_unlock(&pool->lock);
 
-    // blob of data in file: ->WidthCb (Width + padding) * ->Height
-    // blob = ->Width * ->Height
-    unsigned char* colordata;
-    if (!(colordata = calloc(1, (k.Width * k.Height) * k.BitsPerPixel)))
-        return errno = EADDRINUSE, false;
+    if (!block && !(block = malloc(sizeof(POOL_BLOCK) + capacity)))
+        return NULL;
+    block->hdr.size_class = size_class;
+    return block + 1;
+}
 
-    // this won't work!
-    if (k.WidthCb < k.Width) {
-        fprintf(stderr, "\nCorrupted picture, .DDB->ScanlineWidth is less than than image width.");
-        errno = EINVAL;
-        return false;
+static void pool_free(void* user, void* p) {
+
+    BMP_POOL* pool = user;
+    POOL_BLOCK* block = (POOL_BLOCK*)p - 1;
+    const unsigned size_class = block->hdr.size_class;
+    const size_t capacity = pool_capacity(size_class);
+
+    pthread_mutex_lock(&pool->lock);
+    const bool keep = pool->cached + capacity <= pool->max_cached;
+    if (keep) {
+        block->hdr.next = pool->free[size_class];
+        pool->free[size_class] = block;
+        pool->cached += capacity;
     }
+    pthread_mutex_unlock(&pool->lock);
+    if (!keep)
+        free(block);
+}
+
+bool bmp_pool_init(BMP_POOL* pool, size_t max_cached) {
+    memset(pool, 0, sizeof(BMP_POOL));
+    if (pthread_mutex_init(&pool->lock, NULL))
+        return false;
+    pool->allocator.alloc = pool_alloc;
+    pool->allocator.release = pool_free;
+    pool->allocator.user = pool;
+    pool->max_cached = max_cached;
+    return true;
+}
+
+void bmp_pool_destroy(BMP_POOL* pool) {
+    for (unsigned i = 0; i < BMP_POOL_CLASSES; ++i)
+        for (POOL_BLOCK* block = pool->free[i], *next; block; block = next) {
+            next = block->hdr.next;
+            free(block);
+        }
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool->free, 0, sizeof(pool->free));
+    pool->cached = 0;
+}
+
+// Largest file + info header, enough to decode any header in one read
+#define CB_SERIALIZED_BITMAPHEADERS_MAX (CB_SERIALIZED_BITMAPFILEHEADER + CB_SERIALIZED_BITMAPV5INFOHEADER)
+
+//      Serialized header layout, offsets from the start of the file:
+//
+//  [0x00] file header (14)
+//  [0x0E] info header (->info.hdrsize)
+//  [0x0E + hdrsize] NT masks (bitfields, v3 only) / color table (RGB triples for core headers)
+//  [->BlobIndex] pixel array
+//
+//  .DDB files are a 10 byte header and the pixel array: no color table, top row first,
+//  rows ->WidthCb bytes apart. They are decoded into the same fields, see decode_ddb_header.
+
+// DDBs are decoded with info.hdrsize set to the size of their one header
+static inline bool bmp_is_ddb(const UNSERIAL_BITMAP* hdr) {
+    return CB_SERIALIZED_BITMAPV1FILEHEADER == hdr->info.hdrsize;
+}
 
-    unsigned char* padding;
-    if (!(padding = malloc(k.WidthCb - k.Width + 1)))
-        return errno = EADDRINUSE, false;
+// Bytes of headers in front of the color table
+static inline size_t bmp_headers_bytes(const UNSERIAL_BITMAP* hdr) {
+    return bmp_is_ddb(hdr) ? CB_SERIALIZED_BITMAPV1FILEHEADER : CB_SERIALIZED_BITMAPFILEHEADER + (size_t)hdr->info.hdrsize;
+}
+
+// Checks decoded headers before anything is sized from them: every size computed from
+//  Width, Height and BitCount downstream (rows, strides, whole pixel arrays plus slack)
+//  fits a size_t once these pass.
+static bool validate_bmp_headers(const UNSERIAL_BITMAP* hdr) {
 
-    // read each line without padding
-    uint8_t* j = colordata;
-    const size_t line_width = k.Width * k.Height,
-                 padded_width = k.WidthCb;
-    for (uint16_t i = 0; (i < k.Height) && (j < colordata + (k.BitsPerPixel * (k.Width * k.Height))); ++i) {
-        if ((k.Width * k.BitsPerPixel) != fread(j, k.BitsPerPixel, k.Width, bmpfp))
+    const int32_t width = hdr->info.bmp3.Width, height = hdr->info.bmp3.Height;
+    if ((width <= 0) || !height || (INT32_MIN == height))
+        return errno = EBADF, false;
+    switch (hdr->info.bmp3.BitCount) {
+        case 1: case 2: case 4: case 8: case 16: case 24: case 32:
+        break;
+        default:
             return errno = EBADF, false;
-        read_deserealize_blob(j, (k.Width * k.BitsPerPixel), rfp);
-        read_deserealize_blob(padding, (k.BitsPerPixel * (k.WidthCb - k.Width)), rfp);
-        j += (k.BitsPerPixel * k.Width);
     }
+    switch (hdr->info.bmp3.Compression) {
+        case BMP_COMPRESSION_NONE:
+        break;
+        case BMP_COMPRESSION_RLE8:
+        case BMP_COMPRESSION_RLE4:
+            // rows run bottom up only
+            if ((height < 0) || (hdr->info.bmp3.BitCount != ((BMP_COMPRESSION_RLE8 == hdr->info.bmp3.Compression) ? 8 : 4)))
+                return errno = EBADF, false;
+        break;
+        case BMP_COMPRESSION_BITFIELDS:
+            if ((16 != hdr->info.bmp3.BitCount) && (32 != hdr->info.bmp3.BitCount))
+                return errno = EBADF, false;
+        break;
+        default:
+            return errno = ENOTSUP, false;
+    }
+    if (hdr->file.bmp.BlobIndex < bmp_headers_bytes(hdr))
+        return errno = EBADF, false;
+
+    // below 2^31 x 2^31 pixels and 2^36 bits a row, none of these products wrap (DDB
+    //  strides are 16 bit)
+    const uint64_t rows = (uint64_t)((height < 0) ? -(int64_t)height : height),
+                   stride = ((uint64_t)width * hdr->info.bmp3.BitCount + 31) / 32 * 4;
+    if (BMP_MAX_PIXELS && ((uint64_t)width * rows > BMP_MAX_PIXELS))
+        return errno = EFBIG, false;
+    if ((stride > SIZE_MAX / 8) || (rows > (SIZE_MAX / 8) / stride))
+        return errno = EFBIG, false;
+    return true;
+}
+
+// Offset one past the last byte of an uncompressed pixel array: the last row's padding
+//  may be missing from the file. Headers must have passed validate_bmp_headers.
+static uint64_t bmp_pixel_array_end(const UNSERIAL_BITMAP* hdr) {
+    const uint64_t rows = (uint64_t)abs(hdr->info.bmp3.Height);
+    return (uint64_t)hdr->file.bmp.BlobIndex + (rows - 1) * bmp_row_stride(hdr) + bmp_row_bytes(hdr);
+}
+
+// Holds an image the parsers are about to allocate cb bytes for to the caller's budgets
+//  in hdr (->max_pixels, ->max_bytes). Headers must have passed validate_bmp_headers.
+static bool check_parse_budget(const UNSERIAL_BITMAP* hdr, uint64_t cb) {
+    const uint64_t pixels = (uint64_t)hdr->info.bmp3.Width * (uint64_t)abs(hdr->info.bmp3.Height);
+    if ((hdr->max_pixels && (pixels > hdr->max_pixels)) || (hdr->max_bytes && (cb > hdr->max_bytes)))
+        return errno = EFBIG, false;
+    return true;
+}
+
+// What callers set in out before parsing (allocator, budgets) carried into a parser's work copy
+static void parse_settings(UNSERIAL_BITMAP* work, const UNSERIAL_BITMAP* out) {
+    work->allocator = out->allocator;
+    work->max_pixels = out->max_pixels;
+    work->max_bytes = out->max_bytes;
+}
+
+// .DDB header into out->file.ddb, with what the rest of the library reads widened into
+//  out->info.bmp3 (a top-down, uncompressed bitmap) and BlobIndex, which file.ddb does not
+//  overlap. bmp_row_stride takes the stride from file.ddb.
+static bool decode_ddb_header(const unsigned char* p, size_t cb, UNSERIAL_BITMAP* out) {
 
-    memcpy(&out->base_hdr, &k, sizeof(k));
-    out->blob = colordata;
-    errno = 0;
+    if (cb < CB_SERIALIZED_BITMAPV1FILEHEADER)
+        return errno = EBADF, false;
+
+    UNSERIAL_DDBFILEHEADER* ddb = &out->file.ddb;
+    ddb->Type = load_little_u16(p);
+    ddb->Width = load_little_u16(p + 2);
+    ddb->Height = load_little_u16(p + 4);
+    ddb->WidthCb = load_little_u16(p + 6);
+    ddb->Planes = p[8];
+    ddb->BitsPerPixel = p[9];
+    out->file.bmp.BlobIndex = CB_SERIALIZED_BITMAPV1FILEHEADER;
+
+    memset(&out->info, 0, sizeof(out->info));
+    out->info.hdrsize = CB_SERIALIZED_BITMAPV1FILEHEADER;
+    out->info.bmp3.Width = ddb->Width;
+    out->info.bmp3.Height = -(int32_t)ddb->Height;
+    out->info.bmp3.Planes = ddb->Planes;
+    out->info.bmp3.BitCount = ddb->BitsPerPixel;
+    out->info.bmp3.Compression = BMP_COMPRESSION_NONE;
+    out->info.bmp3.SizeImage = (uint32_t)ddb->WidthCb * ddb->Height;
+
+    // plane interleaved (EGA) bitmaps are not decoded
+    if (DDB_PLANES_CONST != ddb->Planes)
+        return errno = ENOTSUP, false;
+    if ((1 != ddb->BitsPerPixel) && (4 != ddb->BitsPerPixel) && (8 != ddb->BitsPerPixel))
+        return errno = EBADF, false;
+    if (!validate_bmp_headers(out))
+        return false;
+    if (ddb->WidthCb < bmp_row_bytes(out))
+        return errno = EBADF, false;
     return true;
 }
 
-bool gen_bmp_v1(FILE* wfp, const UNSERIAL_BITMAPV1* in) {
+// OS/2 1.x core header (12 bytes): 16 bit unsigned sizes, bottom-up and uncompressed
+static void decode_core_header(const unsigned char* info, UNSERIAL_BITMAP* out) {
+    out->info.bmp3.Width = load_little_u16(info + 4);
+    out->info.bmp3.Height = load_little_u16(info + 6);
+    out->info.bmp3.Planes = load_little_u16(info + 8);
+    out->info.bmp3.BitCount = load_little_u16(info + 10);
+    out->info.bmp3.Compression = BMP_COMPRESSION_NONE;
+    out->info.bmp3.SizeImage = 0;
+    out->info.bmp3.XPxPerMeter = 0;
+    out->info.bmp3.YPxPerMeter = 0;
+    out->info.bmp3.ClrUsed = 0;
+    out->info.bmp3.ClrImportant = 0;
+}
+
+// Decodes file + info header out of the first cb bytes of a .BMP (or .DDB) file into
+//  out->file, out->info
+static bool decode_bmp_headers(const unsigned char* p, size_t cb, UNSERIAL_BITMAP* out) {
 
-    errno = 0;
-    rewind(wfp);
+    if ((cb >= 2) && (DDB_TYPE_MAGIC == load_little_u16(p)))
+        return decode_ddb_header(p, cb, out);
+    if (cb < CB_SERIALIZED_BITMAPFILEHEADER + 4)
+        return errno = EBADF, false;
 
-    UNSERIAL_BITMAPV1FILEHEADER hdr = {0};
-    memcpy(&hdr, &in->base_hdr, sizeof(hdr));
-    // autogenerate some helpful values if they're uninitialized
-    // No padding? Seems unlikely but ok
-    if (in->base_hdr.WidthCb < in->base_hdr.Width) {
-        fprintf(stderr, "\nCorrupted input. .DDB->ScanlineWidth is less than image width.\n\tAssuming 0 padding.");
-        hdr.WidthCb = in->base_hdr.Width;
+    out->file.bmp.Type = load_little_u16(p);
+    if (BMP_TYPE_MAGIC != out->file.bmp.Type)
+        return errno = EBADF, false;
+    out->file.bmp.Size = load_little_u32(p + 2);
+    out->file.bmp.Reserved1 = load_little_u16(p + 6);
+    out->file.bmp.Reserved2 = load_little_u16(p + 8);
+    out->file.bmp.BlobIndex = load_little_u32(p + 10);
+
+    const unsigned char* info = p + CB_SERIALIZED_BITMAPFILEHEADER;
+    out->info.hdrsize = load_little_u32(info);
+    switch (out->info.hdrsize) {
+        case CB_SERIALIZED_BITMAPV3INFOHEADER:
+        case CB_SERIALIZED_BITMAPV4INFOHEADER:
+        case CB_SERIALIZED_BITMAPV5INFOHEADER:
+        case CB_SERIALIZED_BITMAPV2INFOHEADER:
+        break;
+        default:
+            return errno = EBADF, false;
     }
-    // multiple planes?? does this look like xcf to you?
-    if (in->base_hdr.Planes != 1) {
-        fprintf(stderr, "\nCorrupted input. .DDB multiple planes are not supported.\n\tAssuming 1 plane.");
-        hdr.Planes = 1;
+    if (cb < CB_SERIALIZED_BITMAPFILEHEADER + (size_t)out->info.hdrsize)
+        return errno = EBADF, false;
+    if (CB_SERIALIZED_BITMAPV2INFOHEADER == out->info.hdrsize) {
+        decode_core_header(info, out);
+        return validate_bmp_headers(out);
     }
-    
-    const uint16_t DDB_FILE = DDB_TYPE_MAGIC;
-    write_serialize(&DDB_FILE, wfp);
-    write_serialize(&hdr.Width, wfp);
-    write_serialize(&hdr.Height, wfp);
-    write_serialize(&hdr.WidthCb, wfp);
-    write_serialize(&hdr.Planes, wfp);
-    write_serialize(&hdr.BitsPerPixel, wfp);
 
-    unsigned char* padding;
-    if (!(padding = calloc(hdr.WidthCb - hdr.Width + 1, 1))) 
-        return errno = EADDRINUSE, false;
+    out->info.bmp3.Width = (int32_t)load_little_u32(info + 4);
+    out->info.bmp3.Height = (int32_t)load_little_u32(info + 8);
+    out->info.bmp3.Planes = load_little_u16(info + 12);
+    out->info.bmp3.BitCount = load_little_u16(info + 14);
+    out->info.bmp3.Compression = load_little_u32(info + 16);
+    out->info.bmp3.SizeImage = load_little_u32(info + 20);
+    out->info.bmp3.XPxPerMeter = (int32_t)load_little_u32(info + 24);
+    out->info.bmp3.YPxPerMeter = (int32_t)load_little_u32(info + 28);
+    out->info.bmp3.ClrUsed = load_little_u32(info + 32);
+    out->info.bmp3.ClrImportant = load_little_u32(info + 36);
 
-    const unsigned char* j = in->blob;
-    for (uint16_t i = 0; (i < hdr.Height) && (j < in->blob + (in->base_hdr.Width * in->base_hdr.Height)); ++i) {
-        write_serialize_blob(j, hdr.Width, wfp);
-        if (hdr.WidthCb > hdr.Width)
-            write_serialize_blob(padding, (hdr.WidthCb - hdr.Width), wfp);
-        j += hdr.BitsPerPixel * hdr.Height;
+    // masks directly follow a v3 header, and are part of v4+ headers
+    if (BMP_COMPRESSION_BITFIELDS == out->info.bmp3.Compression
+        || out->info.hdrsize >= CB_SERIALIZED_BITMAPV4INFOHEADER) {
+        if (cb < CB_SERIALIZED_BITMAPFILEHEADER + CB_SERIALIZED_BITMAPV3INFOHEADER + 12)
+            return errno = EBADF, false;
+        out->info.bmp3_nt.RedMask = load_little_u32(info + 40);
+        out->info.bmp3_nt.GreenMask = load_little_u32(info + 44);
+        out->info.bmp3_nt.BlueMask = load_little_u32(info + 48);
     }
+    if (out->info.hdrsize >= CB_SERIALIZED_BITMAPV4INFOHEADER) {
+        UNSERIAL_BITMAPV4INFOHEADER* v4 = &out->info.bmp4;
+        v4->AlphaMask = load_little_u32(info + 52);
+        v4->CSType = load_little_u32(info + 56);
+        BMP_CIEXYZ* xyz[] = { &v4->Endpoints.Red, &v4->Endpoints.Green, &v4->Endpoints.Blue };
+        for (unsigned i = 0; i < 3; ++i) {
+            xyz[i]->X = (int32_t)load_little_u32(info + 60 + i * 12);
+            xyz[i]->Y = (int32_t)load_little_u32(info + 64 + i * 12);
+            xyz[i]->Z = (int32_t)load_little_u32(info + 68 + i * 12);
+        }
+        v4->GammaRed = load_little_u32(info + 96);
+        v4->GammaGreen = load_little_u32(info + 100);
+        v4->GammaBlue = load_little_u32(info + 104);
+    }
+    if (out->info.hdrsize >= CB_SERIALIZED_BITMAPV5INFOHEADER) {
+        out->info.bmp5.Intent = load_little_u32(info + 108);
+        out->info.bmp5.ProfileData = load_little_u32(info + 112);
+        out->info.bmp5.ProfileSize = load_little_u32(info + 116);
+        out->info.bmp5.Reserved = load_little_u32(info + 120);
+    }
+    return validate_bmp_headers(out);
+}
 
-    rewind(wfp);
-    errno = 0;
+bool bmp_icc_profile(const UNSERIAL_BITMAP* hdr, uint64_t* offset, uint32_t* size) {
+    // ProfileData counts from the start of the info header
+    if ((hdr->info.hdrsize < CB_SERIALIZED_BITMAPV5INFOHEADER) || !hdr->info.bmp5.ProfileSize
+        || ((PROFILE_EMBEDDED != hdr->info.bmp5.CSType) && (PROFILE_LINKED != hdr->info.bmp5.CSType)))
+        return errno = ENOENT, false;
+    *offset = (uint64_t)CB_SERIALIZED_BITMAPFILEHEADER + hdr->info.bmp5.ProfileData;
+    *size = hdr->info.bmp5.ProfileSize;
     return true;
-}*/
+}
 
-// TODO
-bool parse_ddb(FILE* ddb_read, UNSERIAL_BITMAP* out) { return false; }
-bool parse_bmp2(FILE* bmp2_read, UNSERIAL_BITMAP* out) {
-    return false;
+const void* bmp_icc_profile_view(const UNSERIAL_BITMAP* hdr, const void* data, size_t cb, uint32_t* size) {
+    uint64_t offset;
+    if (!bmp_icc_profile(hdr, &offset, size))
+        return NULL;
+    if ((offset > cb) || (*size > cb - offset))
+        return errno = EBADF, NULL;
+    return (const unsigned char*)data + offset;
 }
+
 bool parse_bmp3(FILE* bmp3_read, UNSERIAL_BITMAP* out);
 
+// Headers widened by decode_bmp_headers, DDBs and core header bitmaps take the v3 path
+bool parse_ddb(FILE* ddb_read, UNSERIAL_BITMAP* out) {
+    return parse_bmp3(ddb_read, out);
+}
+
+bool parse_bmp2(FILE* bmp2_read, UNSERIAL_BITMAP* out) {
+    return parse_bmp3(bmp2_read, out);
+}
+
 bool parse_bmp4(FILE* bmp4_read, UNSERIAL_BITMAP* out) { return false; }
 bool parse_bmp5(FILE* bmp5_read, UNSERIAL_BITMAP* out) { return false; }
 
@@ -185,80 +490,41 @@ bool parse_bmp_array(FILE* bmp3_array, UNSERIAL_BITMAP* out);
 
 bool parse_bmp(FILE* bmp_read, UNSERIAL_BITMAP* out) {
 
-    UNSERIAL_BITMAP work = {0}, *work_nonlocal;
+    UNSERIAL_BITMAP work = {0};
+    parse_settings(&work, out);
 
-    // first 16-bit value of bmp file is flag
-    // 00 00 for .DDB (v1) and 42 4D "BM" for .BMP (v2+)
+    // file and info header are read in one go, then decoded from memory
+    unsigned char hdr[CB_SERIALIZED_BITMAPHEADERS_MAX];
     rewind(bmp_read);
-    if (!fread_little_value(&work.file.bmp.Type, 2, 1, bmp_read))
-        return false;
-    
-    switch (work.file.bmp.Type) {
-        // Bitmap v1 is a different format
-        case DDB_TYPE_MAGIC:
-        // TODO
-            return parse_ddb(bmp_read, out);
-        break;
-        case BMP_TYPE_MAGIC:
-        break;
-        default:
-            printf("\nInvalid bitmap file: header magic not recognized.");
-            return errno = EBADF, false;
-    };
-
-    if (!fread_little_value(&work.file.bmp.Size, 4, 1, bmp_read))
-        return false;
-    if (!fread_little_value(&work.file.bmp.Reserved1, 2, 1, bmp_read))
-        return false;
-    if (!fread_little_value(&work.file.bmp.Reserved2, 2, 1, bmp_read))
-        return false;
-    if (!fread_little_value(&work.file.bmp.BlobIndex, 4, 1, bmp_read))
-        return false;
+    const size_t cbhdr = fread(hdr, 1, sizeof(hdr), bmp_read);
+    if (cbhdr < 2)
+        return errno = EBADF, false;
 
-    //fseek(bmp_read, CB_SERIALIZED_BITMAPFILEHEADER, SEEK_SET);
-    // Info header (version dependent) immediately follows file header
-    // Version is determined by size
-    if (!fread_little_value(&work.info.bmp3.Size, 4, 1, bmp_read))
-        return false;
-    // TODO
-    // if bmp v2 then width and height are 16bit
-    if (!fread_little_value(&work.info.bmp3.Width, ((work.info.bmp2.Size == CB_SERIALIZED_BITMAPV2FILEHEADER) ? 2 : 4), 1, bmp_read))
-        return false;
-    if (!fread_little_value(&work.info.bmp3.Height, ((work.info.bmp2.Size == CB_SERIALIZED_BITMAPV2FILEHEADER) ? 2 : 4), 1, bmp_read))
-        return false;
-    if (!fread_little_value(&work.info.bmp3.Planes, 2, 1, bmp_read))
-        return false;
-    if (!fread_little_value(&work.info.bmp3.BitCount, 2, 1, bmp_read))
+    // first 16-bit value of bmp file is flag
+    // 00 00 for .DDB (v1) and 42 4D "BM" for .BMP (v2+)
+    if (!decode_bmp_headers(hdr, cbhdr, &work))
         return false;
 
-    // try not to modify out unless on success
-    if (!(work_nonlocal = calloc(1, sizeof(UNSERIAL_BITMAP))))
-        return errno = EADDRINUSE, false;
-    memcpy(work_nonlocal, &work, sizeof(UNSERIAL_BITMAP));
-    
     bool sub_bmp_parse_success = false;
-    switch (work.info.bmp3.Size) {
+    switch (work.info.hdrsize) {
+        // Bitmap v1 is a different format, with its header widened to the v3 fields
+        case CB_SERIALIZED_BITMAPV1FILEHEADER:
+            sub_bmp_parse_success = parse_ddb(bmp_read, &work);
+        break;
         case CB_SERIALIZED_BITMAPV2INFOHEADER:
-            sub_bmp_parse_success = parse_bmp2(bmp_read, work_nonlocal);
+            sub_bmp_parse_success = parse_bmp2(bmp_read, &work);
         break;
+        // v4 and v5 extend the v3 layout
         case CB_SERIALIZED_BITMAPV3INFOHEADER:
-            printf("v3");
-            sub_bmp_parse_success = parse_bmp3(bmp_read, work_nonlocal);
-        break;
         case CB_SERIALIZED_BITMAPV4INFOHEADER:
-            printf("It's a v4 bitmap\n");
-             sub_bmp_parse_success = parse_bmp3(bmp_read, work_nonlocal);
-        break;
         case CB_SERIALIZED_BITMAPV5INFOHEADER:
-            printf("It's a v5 bitmap");
+            sub_bmp_parse_success = parse_bmp3(bmp_read, &work);
         break;
-        default:
-        printf("\nInvalid bitmap file: info header size not recognized.%i", work.info.bmp2.Size);
-        errno = EBADF;
     };
 
-    memcpy(out, work_nonlocal, sizeof(UNSERIAL_BITMAP));
-    free(work_nonlocal);
+    // try not to modify out unless on success
+    if (sub_bmp_parse_success)
+        memcpy(out, &work, sizeof(UNSERIAL_BITMAP));
     return sub_bmp_parse_success;
 }
 
@@ -266,119 +532,3895 @@ bool parse_bmp_blob(FILE* bmp_read, UNSERIAL_BITMAP* out) {
 
 }
 
-// assert bmp3_read points to a valid bitmap 3 file parsed by this library
-bool parse_bmp3(FILE* bmp3_read, UNSERIAL_BITMAP* out) {
+// OS/2 core headers are followed by B G R triples rather than RGBQUADs
+static inline size_t bmp_palette_entry_bytes(const UNSERIAL_BITMAP* hdr) {
+    return (CB_SERIALIZED_BITMAPV2INFOHEADER == hdr->info.hdrsize) ? 3 : sizeof(RGBQUAD);
+}
 
-    rewind(bmp3_read);
-    //  +4 because width and height are 2 bytes longer each in v3
-    fseek(bmp3_read, CB_SERIALIZED_BITMAPFILEHEADER + CB_SERIALIZED_BITMAPV2INFOHEADER + 4, SEEK_SET);
-// bmp 3 contains additional fields in the info header
-    if (!fread_little_value(&out->info.bmp3.Compression, sizeof(out->info.bmp3.Compression), 1, bmp3_read))
-        return false;
-    if (!fread_little_value(&out->info.bmp3.SizeImage, sizeof(out->info.bmp3.SizeImage), 1, bmp3_read))
-        return false;
-    if (!fread_little_value(&out->info.bmp3.XPxPerMeter, sizeof(out->info.bmp3.XPxPerMeter), 1, bmp3_read))
-        return false;
-    if (!fread_little_value(&out->info.bmp3.YPxPerMeter, sizeof(out->info.bmp3.YPxPerMeter), 1, bmp3_read))
-        return false;
-    if (!fread_little_value(&out->info.bmp3.ClrUsed, sizeof(out->info.bmp3.ClrUsed), 1, bmp3_read))
-        return false;
-    if (!fread_little_value(&out->info.bmp3.ClrImportant, sizeof(out->info.bmp3.ClrImportant), 1, bmp3_read))
-        return false;
+// Spreads count entries, read as they are in the file to the start of palette, to RGBQUADs.
+//  Back to front: every entry lands past the triples still to be read.
+static void bmp_palette_widen(const UNSERIAL_BITMAP* hdr, RGBQUAD* palette, size_t count) {
+    if (3 != bmp_palette_entry_bytes(hdr))
+        return;
+    const unsigned char* triples = (const unsigned char*)palette;
+    while (count--) {
+        const unsigned char* t = triples + count * 3;
+        const unsigned char b = t[0], g = t[1], r = t[2];
+        palette[count].rgbBlue = b;
+        palette[count].rgbGreen = g;
+        palette[count].rgbRed = r;
+        palette[count].rgbReserved = 0;
+    }
+}
 
-    // special case: windows 3 has extra fields if compression = 3
-    if (BMP_COMPRESSION_BITFIELDS == out->info.bmp3.Compression) {
-        if (!fread_little_value(&out->info.bmp3_nt.RedMask, 4, 1, bmp3_read))
-            return false;
-        if (!fread_little_value(&out->info.bmp3_nt.BlueMask, 4, 1, bmp3_read))
-            return false;
-        if (!fread_little_value(&out->info.bmp3_nt.GreenMask, 4, 1, bmp3_read))
-            return false;
+// Color table: follows the info header (and v3 NT masks), and runs up to the pixel array at most.
+//  Only indexed images get one, above 8bpp it is merely an optimization hint. DDBs have
+//  none, see bmp_palette_init.
+static size_t bmp_palette_extent(const UNSERIAL_BITMAP* hdr, size_t* offset) {
+
+    *offset = bmp_headers_bytes(hdr);
+    if ((CB_SERIALIZED_BITMAPV3INFOHEADER == hdr->info.hdrsize) && (BMP_COMPRESSION_BITFIELDS == hdr->info.bmp3.Compression))
+        *offset += 12;
+    if (bmp_is_ddb(hdr) || (hdr->info.bmp3.BitCount > 8) || !hdr->info.bmp3.BitCount || (*offset > hdr->file.bmp.BlobIndex))
+        return 0;
+
+    size_t count = hdr->info.bmp3.ClrUsed;
+    const size_t max = (size_t)1 << hdr->info.bmp3.BitCount, entry = bmp_palette_entry_bytes(hdr);
+    if (!count || (count > max))
+        count = max;
+    if (count > (hdr->file.bmp.BlobIndex - *offset) / entry)
+        count = (hdr->file.bmp.BlobIndex - *offset) / entry;
+    return count;
+}
+
+static bool read_bmp_palette(FILE* bmp_read, UNSERIAL_BITMAP* out) {
+
+    size_t offset;
+    const size_t count = bmp_palette_extent(out, &offset);
+    if (!count)
+        return true;
+
+    RGBQUAD* array = bmp_alloc(out->allocator, count * sizeof(RGBQUAD));
+    if (!array)
+        return errno = ENOMEM, false;
+    const size_t entry = bmp_palette_entry_bytes(out);
+    if (fseeko(bmp_read, (off_t)offset, SEEK_SET) || (count != fread(array, entry, count, bmp_read))) {
+        bmp_free(out->allocator, array);
+        return errno = EIO, false;
     }
+    bmp_palette_widen(out, array, count);
+    out->palette.array = array;
+    out->palette.count = count;
+    return true;
+}
+
+static bool decode_bmp_palette(const unsigned char* p, size_t cb, UNSERIAL_BITMAP* out) {
+
+    size_t offset;
+    const size_t count = bmp_palette_extent(out, &offset);
+    if (!count)
+        return true;
+    const size_t entry = bmp_palette_entry_bytes(out);
+    if (offset + count * entry > cb)
+        return errno = EBADF, false;
+
+    if (!(out->palette.array = bmp_alloc(out->allocator, count * sizeof(RGBQUAD))))
+        return errno = ENOMEM, false;
+    memcpy(out->palette.array, p + offset, count * entry);
+    bmp_palette_widen(out, out->palette.array, count);
+    out->palette.count = count;
+    return true;
+}
 
-    return parse_bmp_array(bmp3_read, out);
+// assert out->info was decoded from bmp3_read by this library
+bool parse_bmp3(FILE* bmp3_read, UNSERIAL_BITMAP* out) {
+    // bmp 3 header fields, including NT masks, are decoded with the file header
+    if (!read_bmp_palette(bmp3_read, out))
+        return false;
+    if (!parse_bmp_array(bmp3_read, out)) {
+        bmp_free(out->allocator, out->palette.array);
+        out->palette.array = NULL;
+        out->palette.count = 0;
+        return false;
+    }
+    return true;
 }
 
-typedef bool (*bmp_for_each_pixel)(int32_t row, int32_t col, unsigned R, unsigned G, unsigned B);
+// Reads count rows of row_bytes pixel data, stride bytes apart on disk, from the current position.
+//  Rows land dst_stride bytes apart; when that is the on disk stride, padding comes along
+//  and the whole run is a single fread, otherwise padding is skipped over.
+static bool fread_bmp_rows(FILE* bmp_read, size_t count, size_t row_bytes, size_t stride, unsigned char* dst, size_t dst_stride) {
 
-bool blit_console(const UNSERIAL_BITMAP* in) {
-    
-    //uint32_t alpha_pixel = *(uint32_t*)in->blob;
-    unsigned char* p = in->blob;
-    unsigned char alpha_pixel[3] = {0};
-    memcpy(alpha_pixel, in->blob, 3);
-    for (unsigned int i = 0; i < abs(in->info.bmp3.Height); ++i) {
-        printf("\33[%d;%dH", in->info.bmp3.Height - i, 0U);
-        for (unsigned int j = 0; j < abs(in->info.bmp3.Width); ++j) {
-            if (!memcmp(alpha_pixel, p, 3))
-                printf("  ");
-            else printf("XX");
-            p += 3;
-        }
-        printf("%i\n", i);
+    if (!count)
+        return true;
+    if (dst_stride == stride) {
+        // the last row's padding is not needed
+        const size_t cb = count * stride - (stride - row_bytes);
+        return (cb == fread(dst, 1, cb, bmp_read)) || (errno = EIO, false);
+    }
+    for (size_t i = 0; i < count; ++i, dst += dst_stride) {
+        if (row_bytes != fread(dst, 1, row_bytes, bmp_read))
+            return errno = EIO, false;
+        if ((stride > row_bytes) && (i + 1 < count))
+            if (fseek(bmp_read, (long)(stride - row_bytes), SEEK_CUR))
+                return false;
     }
+    return true;
 }
 
 bool parse_bmp_compression_none(FILE* bmp_read, UNSERIAL_BITMAP* out) {
-    fseek(bmp_read, out->file.bmp.BlobIndex, SEEK_SET);
 
-    fpos_t pixel_array = {0};
-    fgetpos(bmp_read, &pixel_array);
+    // the pixel array must all be there before it is allocated for
+    if (fseeko(bmp_read, 0, SEEK_END))
+        return false;
+    const off_t cbfile = ftello(bmp_read);
+    if ((cbfile < 0) || ((uint64_t)cbfile < bmp_pixel_array_end(out)))
+        return errno = EIO, false;
+    if (fseeko(bmp_read, out->file.bmp.BlobIndex, SEEK_SET))
+        return false;
 
-    const size_t cbrow = abs(out->info.bmp3.Width) * (out->info.bmp3.BitCount / CHAR_BIT);
+    const size_t cbrow = bmp_row_bytes(out);
+    if (!check_parse_budget(out, cbrow * abs(out->info.bmp3.Height)))
+        return false;
     // alpha channel not integrated into bmpv2-
-    unsigned char* pix_array = calloc(cbrow * abs(out->info.bmp3.Height), 1);
+    // every byte is read over, no need to zero
+    unsigned char* pix_array = bmp_alloc(out->allocator, cbrow * abs(out->info.bmp3.Height));
     if (!pix_array)
-        return false;
+        return errno = ENOMEM, false;
     
-    // padding bytes must be added so that each row in memory is aligned to a DWORD boundary
-    size_t pad = (cbrow % 4) ? (4 - (cbrow % 4)) : 0;
-    uintmax_t dummy;
+    const size_t stride = bmp_row_stride(out);
 
-    for (size_t i = 0; i < abs(out->info.bmp3.Height); ++i) {
-        unsigned char* this_row = pix_array + cbrow * i;
-        if (cbrow != fread(this_row, 1, cbrow, bmp_read))
-            return false;
-        if (pad)
-            if (pad != fread(&dummy, pad, 1, bmp_read))
-                return false;
+    if (!fread_bmp_rows(bmp_read, abs(out->info.bmp3.Height), cbrow, stride, pix_array, cbrow)) {
+        bmp_free(out->allocator, pix_array);
+        return false;
     }
 
     out->blob = pix_array;
+    out->stride = cbrow;
     return true;
 
 }
 
-bool parse_bmp_array(FILE* bmp_read, UNSERIAL_BITMAP* out) {
-       
-    printf("\n");
-    fseek(bmp_read, out->file.bmp.BlobIndex, SEEK_SET);
+//      RLE8 / RLE4 pixel array, pairs of bytes:
+//
+//  [n > 0] [v]         encoded run: n pixels of v (RLE4: alternating v's high and low nibble)
+//  [0] [0]             end of line
+//  [0] [1]             end of bitmap
+//  [0] [2] [dx] [dy]   delta: skip dx pixels right and dy rows up
+//  [0] [n >= 3] ...    absolute run: n pixels follow, padded to a 16-bit boundary
+//
+// Pixels that are skipped over by delta / end of line / end of bitmap are set to index 0.
+typedef struct {
+    unsigned char* dst;     // row first (bottom row for whole images)
+    size_t dst_stride;
+    uint32_t width, height;
+    uint32_t x, y;          // next pixel to be written
+    // only rows [first, stop) are stored; rows below first are decoded into discard
+    //  and decoding ends at stop
+    uint32_t first, stop;
+    unsigned char* discard;
+} RLE_CURSOR;
 
-    switch (out->info.bmp3.Compression) {
-        case BMP_COMPRESSION_NONE:
-            return parse_bmp_compression_none(bmp_read, out);
+static inline unsigned char* rle_row(const RLE_CURSOR* c) {
+    return (c->y < c->first) ? c->discard : c->dst + (size_t)(c->y - c->first) * c->dst_stride;
+}
+
+// zeroes pixels [c->x, x_end) of row c->y
+static void rle_zero(RLE_CURSOR* c, uint32_t x_end, unsigned bits) {
+    if (c->y < c->first)
+        return;
+    unsigned char* row = rle_row(c);
+    if (8 == bits)
+        memset(row + c->x, 0, x_end - c->x);
+    else {
+        // an odd c->x shares its byte with a pixel already written
+        const size_t first = (c->x + 1) >> 1, last = (x_end + 1) >> 1;
+        if (last > first)
+            memset(row + first, 0, last - first);
+    }
+}
+
+// moves the cursor forward to (x, y), zeroing everything skipped
+static void rle_skip_to(RLE_CURSOR* c, uint32_t x, uint32_t y, unsigned bits) {
+    for (; (c->y < y) && (c->y < c->stop); ++c->y, c->x = 0)
+        rle_zero(c, c->width, bits);
+    if (c->y < c->stop)
+        rle_zero(c, x, bits);
+    c->x = x;
+}
+
+// handles the escapes shared by RLE8 and RLE4, returns false once decoding is over
+//  (*ok tells end of bitmap from corruption)
+static bool rle_escape(RLE_CURSOR* c, const unsigned char** pp, const unsigned char* end, unsigned escape, unsigned bits, bool* ok) {
+    switch (escape) {
+        case 0:
+            rle_skip_to(c, 0, c->y + 1, bits);
+            return true;
+        case 1:
+            rle_skip_to(c, 0, c->height, bits);
+            return *ok = true, false;
+        case 2: {
+            if (end - *pp < 2)
+                return *ok = false, false;
+            const uint32_t dx = (*pp)[0], dy = (*pp)[1];
+            *pp += 2;
+            if ((dx > c->width - c->x) || (dy > c->height - c->y))
+                return *ok = false, false;
+            rle_skip_to(c, c->x + dx, c->y + dy, bits);
+            return true;
+        }
+    }
+    assert(!"absolute runs are not escapes");
+    return *ok = false, false;
+}
+
+static bool decode_rle8(const unsigned char* p, const unsigned char* end, RLE_CURSOR* c) {
+
+    bool ok = true;
+    while ((end - p >= 2) && (c->y < c->stop)) {
+        const uint32_t n = p[0], v = p[1];
+        p += 2;
+        unsigned char* row = rle_row(c);
+
+        if (n) {
+            if (n > c->width - c->x)
+                return errno = EBADF, false;
+            memset(row + c->x, (int)v, n);
+            c->x += n;
+        }
+        else if (v >= 3) {
+            const size_t cbrun = v + (v & 1);
+            if ((v > c->width - c->x) || ((size_t)(end - p) < v))
+                return errno = EBADF, false;
+            memcpy(row + c->x, p, v);
+            c->x += v;
+            p += ((size_t)(end - p) < cbrun) ? (size_t)(end - p) : cbrun;
+        }
+        else if (!rle_escape(c, &p, end, v, 8, &ok))
+            return ok || (errno = EBADF, false);
+    }
+
+    // tolerate a missing end of bitmap
+    rle_skip_to(c, 0, c->stop, 8);
+    return true;
+}
+
+static bool decode_rle4(const unsigned char* p, const unsigned char* end, RLE_CURSOR* c) {
+
+    bool ok = true;
+    while ((end - p >= 2) && (c->y < c->stop)) {
+        const uint32_t n = p[0], v = p[1];
+        p += 2;
+        unsigned char* row = rle_row(c);
+        uint32_t x = c->x;
+
+        if (n) {
+            if (n > c->width - x)
+                return errno = EBADF, false;
+            unsigned hi = v >> 4, lo = v & 0x0F, remaining = n;
+            // odd start: first pixel fills a low nibble, the rest of the run is phase shifted
+            if (x & 1) {
+                row[x >> 1] |= (unsigned char)hi;
+                ++x, --remaining;
+                hi = lo, lo = v >> 4;
+            }
+            memset(row + (x >> 1), (int)((hi << 4) | lo), remaining >> 1);
+            x += remaining & ~1U;
+            if (remaining & 1)
+                row[x++ >> 1] = (unsigned char)(hi << 4);
+            c->x = x;
+        }
+        else if (v >= 3) {
+            const size_t cbpix = (v + 1) >> 1, cbrun = cbpix + (cbpix & 1);
+            if ((v > c->width - x) || ((size_t)(end - p) < cbpix))
+                return errno = EBADF, false;
+            if (!(x & 1)) {
+                memcpy(row + (x >> 1), p, v >> 1);
+                if (v & 1)
+                    row[(x + v) >> 1] = p[v >> 1] & 0xF0;
+            }
+            else {
+                // odd start: every output byte straddles two input bytes
+                unsigned char* o = row + (x >> 1);
+                *o++ |= p[0] >> 4;
+                for (uint32_t i = 1; i + 1 < v; i += 2)
+                    *o++ = (unsigned char)((p[(i - 1) >> 1] << 4) | (p[(i + 1) >> 1] >> 4));
+                if (!(v & 1))
+                    *o = (unsigned char)(p[(v - 1) >> 1] << 4);
+            }
+            c->x = x + v;
+            p += ((size_t)(end - p) < cbrun) ? (size_t)(end - p) : cbrun;
+        }
+        else if (!rle_escape(c, &p, end, v, 4, &ok))
+            return ok || (errno = EBADF, false);
+    }
+
+    rle_skip_to(c, 0, c->stop, 4);
+    return true;
+}
+
+// Decodes file rows [first, stop) only. Rows below first still have to be walked, but
+//  land in discard (bmp_row_bytes long); nothing past stop is looked at.
+static bool decode_rle_rows(const void* src, size_t cb, const UNSERIAL_BITMAP* hdr, uint32_t first, uint32_t stop, unsigned char* dst, size_t dst_stride, unsigned char* discard) {
+
+    RLE_CURSOR c = { dst, dst_stride, (uint32_t)abs(hdr->info.bmp3.Width), (uint32_t)abs(hdr->info.bmp3.Height), 0, 0, first, stop, discard };
+    const unsigned char* p = src;
+
+    switch (hdr->info.bmp3.Compression) {
         case BMP_COMPRESSION_RLE8:
+            if (8 != hdr->info.bmp3.BitCount)
+                return errno = EBADF, false;
+            return decode_rle8(p, p + cb, &c);
         case BMP_COMPRESSION_RLE4:
-        case BMP_COMPRESSION_BITFIELDS:
-            printf("Todo.");
-            exit(0);
+            if (4 != hdr->info.bmp3.BitCount)
+                return errno = EBADF, false;
+            return decode_rle4(p, p + cb, &c);
     }
-    
-    return true;
+    return errno = EINVAL, false;
 }
 
-int main() {
-    
-    FILE* fp = fopen("ie.bmp", "r");
-    if (feof(fp)) {
-        printf("\nbad file");
-        return 0;
+bool bmp_decode_rle(const void* src, size_t cb, const UNSERIAL_BITMAP* hdr, unsigned char* dst, size_t dst_stride) {
+    return decode_rle_rows(src, cb, hdr, 0, (uint32_t)abs(hdr->info.bmp3.Height), dst, dst_stride, NULL);
+}
+
+//      RLE8 / RLE4 encoding
+//
+// Rows are cut into encoded runs where pixels repeat (for RLE4, two alternating indices:
+//  what one encoded byte holds) and absolute runs of whatever lies between. A repeat
+//  shorter than break_run does not end an absolute run, closing one and opening the next
+//  costs more than it saves. Absolute runs under 3 pixels, which the format cannot
+//  express, go out as encoded runs. Every row ends with end of line, the last with end
+//  of bitmap instead, so no pixel is left to a decoder's idea of skipped ones.
+//  Nothing costs over 2 bytes a pixel: a row takes at most 2 * width + 2 bytes.
+
+#define RLE_MAX_RUN 255
+
+typedef struct {
+    unsigned bits;          // 8 or 4
+    size_t period;          // pixels a repeat takes to come round: 1, 2 for RLE4
+    size_t min_run;         // shortest repeat encoded on its own
+    size_t break_run;       //  and in the middle of an absolute run
+    // how many of the first n of px[] follow pattern: its low byte at even offsets, high
+    //  byte at odd ones
+    size_t (*scan)(const unsigned char* px, size_t n, uint16_t pattern);
+    // how many of the first n of px[] differ from the pixel period after them (at most
+    //  n - period): none of those starts a repeat longer than period
+    size_t (*distinct)(const unsigned char* px, size_t n, size_t period);
+} RLE_ENCODER;
+
+static size_t rle_scan(const unsigned char* px, size_t n, uint16_t pattern) {
+    const unsigned char p[2] = { (unsigned char)pattern, (unsigned char)(pattern >> 8) };
+    size_t k = 0;
+    while ((k < n) && (px[k] == p[k & 1]))
+        ++k;
+    return k;
+}
+
+static size_t rle_distinct(const unsigned char* px, size_t n, size_t period) {
+    size_t k = 0;
+    while ((k + period < n) && (px[k] != px[k + period]))
+        ++k;
+    return k;
+}
+
+#ifdef BMP_X86_DISPATCH
+// 16 pixels a compare, the first mismatch found from the byte mask
+__attribute__((target("sse2")))
+static size_t rle_scan_sse2(const unsigned char* px, size_t n, uint16_t pattern) {
+    const __m128i p = _mm_set1_epi16((short)pattern);
+    size_t k = 0;
+    for (; k + 16 <= n; k += 16) {
+        const unsigned differ = 0xFFFFU ^ (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(px + k)), p));
+        if (differ)
+            return k + (size_t)__builtin_ctz(differ);
     }
-    printf("\nfile open.");
-    UNSERIAL_BITMAP a ={0};
-    parse_bmp(fp, &a);
-    blit_console(&a);
-    fclose(fp);
-    return 0;
+    return k + rle_scan(px + k, n - k, pattern);
+}
+
+__attribute__((target("sse2")))
+static size_t rle_distinct_sse2(const unsigned char* px, size_t n, size_t period) {
+    size_t k = 0;
+    for (; k + period + 16 <= n; k += 16) {
+        const unsigned same = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(px + k)), _mm_loadu_si128((const __m128i*)(px + k + period))));
+        if (same)
+            return k + (size_t)__builtin_ctz(same);
+    }
+    return k + rle_distinct(px + k, n - k, period);
+}
+#endif
+
+// n pixels of px[] as an absolute run (padded to 16 bits), as encoded runs when too short
+static unsigned char* rle_absolute(const RLE_ENCODER* enc, const unsigned char* px, size_t n, unsigned char* o) {
+
+    if (n < 3) {
+        if (8 == enc->bits)
+            for (size_t i = 0; i < n; ++i)
+                *o++ = 1, *o++ = px[i];
+        else if (n)
+            *o++ = (unsigned char)n, *o++ = (unsigned char)((px[0] << 4) | ((n > 1) ? px[1] : 0));
+        return o;
+    }
+
+    *o++ = 0, *o++ = (unsigned char)n;
+    size_t cb = n;
+    if (8 == enc->bits)
+        memcpy(o, px, n);
+    else {
+        // most significant nibble first
+        cb = (n + 1) / 2;
+        for (size_t i = 0; i < n / 2; ++i)
+            o[i] = (unsigned char)((px[2 * i] << 4) | px[2 * i + 1]);
+        if (n & 1)
+            o[n / 2] = (unsigned char)(px[n - 1] << 4);
+    }
+    o += cb;
+    if (cb & 1)
+        *o++ = 0;
+    return o;
 }
 
+// One row of width pixels, an index a byte, without its end of line
+static unsigned char* rle_encode_row(const RLE_ENCODER* enc, const unsigned char* px, size_t width, unsigned char* o) {
+
+    // pixels [literal, x) wait to go out as an absolute run
+    size_t x = 0, literal = 0;
+    while (x < width) {
+        if (x > literal) {
+            // pixels that cannot start a repeat join the absolute run wholesale
+            const size_t room = RLE_MAX_RUN - (x - literal), left = width - x,
+                         k = enc->distinct(px + x, (left < room + enc->period) ? left : room + enc->period, enc->period);
+            x += (k < room) ? k : room;
+            if (x - literal == RLE_MAX_RUN) {
+                o = rle_absolute(enc, px + literal, RLE_MAX_RUN, o);
+                literal = x;
+                continue;
+            }
+        }
+        const size_t left = width - x, n = (left < RLE_MAX_RUN) ? left : RLE_MAX_RUN;
+        const unsigned second = ((4 == enc->bits) && (left > 1)) ? px[x + 1] : px[x];
+        const size_t run = enc->scan(px + x, n, (uint16_t)(px[x] | (second << 8)));
+
+        if (run >= ((x > literal) ? enc->break_run : enc->min_run)) {
+            o = rle_absolute(enc, px + literal, x - literal, o);
+            *o++ = (unsigned char)run;
+            *o++ = (unsigned char)((8 == enc->bits) ? px[x] : ((px[x] << 4) | second));
+            literal = x += run;
+            continue;
+        }
+        // joins the absolute run, which is cut at RLE_MAX_RUN pixels
+        x += (run < RLE_MAX_RUN - (x - literal)) ? run : RLE_MAX_RUN - (x - literal);
+        if (x - literal == RLE_MAX_RUN) {
+            o = rle_absolute(enc, px + literal, RLE_MAX_RUN, o);
+            literal = x;
+        }
+    }
+    return rle_absolute(enc, px + literal, x - literal, o);
+}
+
+size_t bmp_rle_bound(const UNSERIAL_BITMAP* in) {
+    const size_t width = (size_t)abs(in->info.bmp3.Width), rows = (size_t)abs(in->info.bmp3.Height);
+    if (!rows || (width > (SIZE_MAX / 2 - 1) / rows))
+        return 0;
+    return (2 * width + 2) * rows;
+}
+
+bool bmp_encode_rle(const UNSERIAL_BITMAP* in, uint32_t compression, void* dst, size_t cb, size_t* written) {
+
+    const unsigned bits = (BMP_COMPRESSION_RLE8 == compression) ? 8 : (BMP_COMPRESSION_RLE4 == compression) ? 4 : 0;
+    if (!bits || (bits != in->info.bmp3.BitCount) || (in->info.bmp3.Width <= 0) || (in->info.bmp3.Height <= 0) || !in->blob)
+        return errno = EINVAL, false;
+
+    RLE_ENCODER enc = { bits, (8 == bits) ? 1 : 2, (8 == bits) ? 2 : 4, (8 == bits) ? 4 : 8, rle_scan, rle_distinct };
+#ifdef BMP_X86_DISPATCH
+    if (cpu_isa() & ISA_SSE2) {
+        enc.scan = rle_scan_sse2;
+        enc.distinct = rle_distinct_sse2;
+    }
+#endif
+
+    // RLE4 rows are unpacked to an index a byte first
+    const size_t width = (size_t)in->info.bmp3.Width, rows = (size_t)in->info.bmp3.Height, row_bound = 2 * width + 2;
+    unsigned char* unpacked = NULL;
+    if ((4 == bits) && !(unpacked = bmp_alloc(in->allocator, width)))
+        return errno = ENOMEM, false;
+
+    unsigned char* o = dst, *end = o + cb;
+    for (size_t y = 0; y < rows; ++y) {
+        if ((size_t)(end - o) < row_bound) {
+            bmp_free(in->allocator, unpacked);
+            return errno = ENOSPC, false;
+        }
+        const unsigned char* px = in->blob + y * in->stride;
+        if (unpacked) {
+            for (size_t x = 0; x < width; ++x)
+                unpacked[x] = (x & 1) ? px[x >> 1] & 0x0F : px[x >> 1] >> 4;
+            px = unpacked;
+        }
+        o = rle_encode_row(&enc, px, width, o);
+        *o++ = 0, *o++ = (y + 1 < rows) ? 0 : 1;
+    }
+    bmp_free(in->allocator, unpacked);
+    *written = (size_t)(o - (unsigned char*)dst);
+    return true;
+}
+
+// The whole compressed array is pulled into memory and decoded from there
+bool parse_bmp_compression_rle(FILE* bmp_read, UNSERIAL_BITMAP* out) {
+
+    // compressed size is SizeImage when given, otherwise the rest of the file
+    if (fseeko(bmp_read, 0, SEEK_END))
+        return false;
+    const off_t cbfile = ftello(bmp_read);
+    if ((cbfile < 0) || ((uintmax_t)cbfile < out->file.bmp.BlobIndex))
+        return errno = EBADF, false;
+    size_t cb = (size_t)(cbfile - out->file.bmp.BlobIndex);
+    if (out->info.bmp3.SizeImage && (out->info.bmp3.SizeImage < cb))
+        cb = out->info.bmp3.SizeImage;
+
+    const size_t cbrow = bmp_row_bytes(out);
+    if (!check_parse_budget(out, (uint64_t)cb + cbrow * abs(out->info.bmp3.Height) + 1))
+        return false;
+    unsigned char* rle = bmp_alloc(out->allocator, cb ? cb : 1);
+    unsigned char* pix_array = bmp_alloc(out->allocator, cbrow * abs(out->info.bmp3.Height) + 1);
+    if (!rle || !pix_array) {
+        bmp_free(out->allocator, rle), bmp_free(out->allocator, pix_array);
+        return errno = ENOMEM, false;
+    }
+
+    bool ok = !fseeko(bmp_read, out->file.bmp.BlobIndex, SEEK_SET)
+        && ((cb == fread(rle, 1, cb, bmp_read)) || (errno = EIO, false))
+        && bmp_decode_rle(rle, cb, out, pix_array, cbrow);
+    bmp_free(out->allocator, rle);
+    if (!ok) {
+        bmp_free(out->allocator, pix_array);
+        return false;
+    }
+
+    out->blob = pix_array;
+    out->stride = cbrow;
+    return true;
+}
+
+bool parse_bmp_array(FILE* bmp_read, UNSERIAL_BITMAP* out) {
+
+    // each path seeks to BlobIndex itself, after sizing the file
+    switch (out->info.bmp3.Compression) {
+        // bitfield pixels are stored like uncompressed ones, see bmp_bitfields_row
+        case BMP_COMPRESSION_NONE:
+        case BMP_COMPRESSION_BITFIELDS:
+            return parse_bmp_compression_none(bmp_read, out);
+        case BMP_COMPRESSION_RLE8:
+        case BMP_COMPRESSION_RLE4:
+            return parse_bmp_compression_rle(bmp_read, out);
+    }
+    
+    return true;
+}
+
+size_t bmp_row_bytes(const UNSERIAL_BITMAP* in) {
+    // magnitude taken in 32 bits: abs(INT32_MIN) is undefined
+    const uint32_t width = (in->info.bmp3.Width < 0) ? 0U - (uint32_t)in->info.bmp3.Width : (uint32_t)in->info.bmp3.Width;
+    return ((size_t)width * in->info.bmp3.BitCount + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+size_t bmp_row_stride(const UNSERIAL_BITMAP* in) {
+    if (bmp_is_ddb(in))
+        return in->file.ddb.WidthCb;
+    // rows are padded to a DWORD boundary on disk
+    return (bmp_row_bytes(in) + 3) & ~(size_t)3;
+}
+
+bool parse_bmp_memory(const void* data, size_t cb, UNSERIAL_BITMAP* out) {
+
+    const unsigned char* p = data;
+    UNSERIAL_BITMAP work = {0};
+    parse_settings(&work, out);
+
+    if (!decode_bmp_headers(p, cb, &work))
+        return false;
+
+    switch (work.info.bmp3.Compression) {
+        case BMP_COMPRESSION_NONE:
+        case BMP_COMPRESSION_BITFIELDS: {
+            // hand back a view of the pixel array
+            const size_t stride = bmp_row_stride(&work);
+            if (bmp_pixel_array_end(&work) > cb)
+                return errno = EBADF, false;
+            if (!check_parse_budget(&work, 0))
+                return false;
+            work.blob = (unsigned char*)p + work.file.bmp.BlobIndex;
+            work.borrowed = true;
+            work.stride = stride;
+        }
+        break;
+        case BMP_COMPRESSION_RLE8:
+        case BMP_COMPRESSION_RLE4: {
+            // decoded straight out of the buffer into a heap blob
+            if (work.file.bmp.BlobIndex > cb)
+                return errno = EBADF, false;
+            size_t cbrle = cb - work.file.bmp.BlobIndex;
+            if (work.info.bmp3.SizeImage && (work.info.bmp3.SizeImage < cbrle))
+                cbrle = work.info.bmp3.SizeImage;
+            const size_t cbrow = bmp_row_bytes(&work);
+            if (!check_parse_budget(&work, cbrow * abs(work.info.bmp3.Height) + 1))
+                return false;
+            if (!(work.blob = bmp_alloc(work.allocator, cbrow * abs(work.info.bmp3.Height) + 1)))
+                return errno = ENOMEM, false;
+            if (!bmp_decode_rle(p + work.file.bmp.BlobIndex, cbrle, &work, work.blob, cbrow)) {
+                bmp_free(work.allocator, work.blob);
+                return false;
+            }
+            work.stride = cbrow;
+        }
+        break;
+        default:
+            return errno = ENOTSUP, false;
+    }
+
+    if (!decode_bmp_palette(p, cb, &work)) {
+        if (!work.borrowed)
+            bmp_free(work.allocator, work.blob);
+        return false;
+    }
+
+    memcpy(out, &work, sizeof(UNSERIAL_BITMAP));
+    return true;
+}
+
+bool parse_bmp_mapped(const char* path, UNSERIAL_BITMAP* out) {
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return errno = EBADF, false;
+    }
+
+    // private + writable: callers may scribble on blob, pages are copied on write only
+    const size_t cb = (size_t)st.st_size;
+    void* base = mmap(NULL, cb, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == base)
+        return false;
+
+    UNSERIAL_BITMAP work = {0};
+    parse_settings(&work, out);
+    if (!parse_bmp_memory(base, cb, &work)) {
+        int err = errno;
+        munmap(base, cb);
+        return errno = err, false;
+    }
+    // compressed images are decoded into a heap blob, the mapping is done with unless it
+    //  still holds an ICC profile for bmp_icc_profile_view
+    uint64_t profile;
+    uint32_t cbprofile;
+    if (!work.borrowed && !bmp_icc_profile(&work, &profile, &cbprofile))
+        munmap(base, cb);
+    else {
+        work.mapping.base = base;
+        work.mapping.size = cb;
+    }
+
+    memcpy(out, &work, sizeof(UNSERIAL_BITMAP));
+    return true;
+}
+
+void free_bmp(UNSERIAL_BITMAP* in) {
+    if (in->mapping.base)
+        munmap(in->mapping.base, in->mapping.size);
+    if (!in->borrowed)
+        bmp_free(in->allocator, in->blob);
+    bmp_free(in->allocator, in->palette.array);
+    in->palette.array = NULL;
+    in->palette.count = 0;
+    in->blob = NULL;
+    in->borrowed = false;
+    in->mapping.base = NULL;
+    in->mapping.size = 0;
+}
+
+bool probe_bmp(FILE* bmp_read, UNSERIAL_BITMAP* out) {
+
+    unsigned char hdr[CB_SERIALIZED_BITMAPHEADERS_MAX];
+    UNSERIAL_BITMAP work = {0};
+
+    rewind(bmp_read);
+    if (!decode_bmp_headers(hdr, fread(hdr, 1, sizeof(hdr), bmp_read), &work))
+        return false;
+
+    memcpy(out, &work, sizeof(UNSERIAL_BITMAP));
+    return true;
+}
+
+bool probe_bmp_path(const char* path, UNSERIAL_BITMAP* out) {
+
+    unsigned char hdr[CB_SERIALIZED_BITMAPHEADERS_MAX];
+    UNSERIAL_BITMAP work = {0};
+
+    // unbuffered: one open, one read, one close per file
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    ssize_t cb = read(fd, hdr, sizeof(hdr));
+    close(fd);
+    if (cb < 0)
+        return false;
+
+    if (!decode_bmp_headers(hdr, (size_t)cb, &work))
+        return false;
+
+    memcpy(out, &work, sizeof(UNSERIAL_BITMAP));
+    return true;
+}
+
+// ===                              ===
+// ===       Worker pool            ===
+// ===                              ===
+
+// One job of a parallel_for. scratch is a per worker slot, freed when the worker is done.
+typedef bool (*PARALLEL_JOB)(void* ctx, size_t job, void** scratch);
+
+typedef struct {
+    PARALLEL_JOB fn;
+    void* ctx;
+    size_t jobs;
+    size_t chunk;           // jobs claimed at a time, so the lock stays cold on large batches
+    size_t next;            // next unclaimed job, guarded by lock
+    size_t failed;
+    int err;                // errno of the first failure merged, guarded by lock
+    pthread_mutex_t lock;
+} PARALLEL_FOR;
+
+static void* parallel_for_worker(void* arg) {
+
+    PARALLEL_FOR* pf = arg;
+    void* scratch = NULL;
+    size_t failed = 0;
+    int err = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pf->lock);
+        const size_t first = pf->next;
+        const size_t last = (pf->jobs - first > pf->chunk) ? first + pf->chunk : pf->jobs;
+        pf->next = last;
+        pthread_mutex_unlock(&pf->lock);
+        if (first == last)
+            break;
+
+        for (size_t i = first; i < last; ++i)
+            if (!pf->fn(pf->ctx, i, &scratch) && !failed++)
+                err = errno;    // errno is per thread, carry it back to the caller
+    }
+
+    free(scratch);
+    pthread_mutex_lock(&pf->lock);
+    pf->failed += failed;
+    if (!pf->err)
+        pf->err = err;
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+// Runs fn over jobs [0, jobs) on up to workers threads (0 = one per online cpu), the
+//  calling thread included. Returns the number of jobs that failed; when any did, errno
+//  is left as one of them set it.
+static size_t parallel_for(unsigned workers, size_t jobs, size_t chunk, PARALLEL_JOB fn, void* ctx) {
+
+    PARALLEL_FOR pf = { .fn = fn, .ctx = ctx, .jobs = jobs, .chunk = chunk ? chunk : 1 };
+    if ((pf.err = pthread_mutex_init(&pf.lock, NULL)))
+        return errno = pf.err, jobs;
+
+    if (!workers) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (online > 0) ? (unsigned)online : 1;
+    }
+    if (workers > (jobs + pf.chunk - 1) / pf.chunk)
+        workers = (unsigned)((jobs + pf.chunk - 1) / pf.chunk);
+
+    pthread_t* threads = (workers > 1) ? calloc(workers - 1, sizeof(pthread_t)) : NULL;
+    unsigned started = 0;
+    if (threads)
+        for (; started < workers - 1; ++started)
+            if (pthread_create(&threads[started], NULL, parallel_for_worker, &pf))
+                break;
+
+    // calling thread works too, and alone when threads are unavailable
+    parallel_for_worker(&pf);
+    for (unsigned i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&pf.lock);
+    if (pf.failed)
+        errno = pf.err ? pf.err : EIO;
+    return pf.failed;
+}
+
+typedef struct {
+    const char* const* paths;
+    UNSERIAL_BITMAP* out;
+    bool* ok;
+} PROBE_BATCH;
+
+static bool probe_bmp_batch_job(void* ctx, size_t i, void** scratch) {
+
+    PROBE_BATCH* batch = ctx;
+    const bool ok = probe_bmp_path(batch->paths[i], &batch->out[i]);
+    if (!ok)
+        memset(&batch->out[i], 0, sizeof(UNSERIAL_BITMAP));
+    if (batch->ok)
+        batch->ok[i] = ok;
+    return ok;
+}
+
+size_t probe_bmp_batch(const char* const* paths, size_t count, UNSERIAL_BITMAP* out, bool* ok, unsigned workers) {
+    PROBE_BATCH batch = { paths, out, ok };
+    return count - parallel_for(workers, count, 64, probe_bmp_batch_job, &batch);
+}
+
+bool bmp_rows_open(BMP_ROW_READER* reader, FILE* bmp_read, size_t capacity) {
+
+    BMP_ROW_READER work = {0};
+
+    if (!capacity)
+        return errno = EINVAL, false;
+    if (!probe_bmp(bmp_read, &work.hdr))
+        return false;
+    switch (work.hdr.info.bmp3.Compression) {
+        case BMP_COMPRESSION_NONE:
+        case BMP_COMPRESSION_BITFIELDS:
+        break;
+        // rows of run length encoded images are not at fixed offsets
+        default:
+            return errno = ENOTSUP, false;
+    }
+
+    work.read = bmp_read;
+    work.row_bytes = bmp_row_bytes(&work.hdr);
+    work.stride = bmp_row_stride(&work.hdr);
+    work.rows = (size_t)abs(work.hdr.info.bmp3.Height);
+    if (capacity > work.rows)
+        capacity = work.rows ? work.rows : 1;
+    work.capacity = capacity;
+    if (!(work.ring = malloc(capacity * work.stride)))
+        return errno = ENOMEM, false;
+
+    memcpy(reader, &work, sizeof(BMP_ROW_READER));
+    return true;
+}
+
+size_t bmp_rows_next(BMP_ROW_READER* reader, size_t n, const unsigned char** rows) {
+
+    if (n > reader->capacity)
+        n = reader->capacity;
+    if (n > reader->rows - reader->next)
+        n = reader->rows - reader->next;
+
+    const bool bottom_up = reader->hdr.info.bmp3.Height > 0;
+    size_t done = 0;
+    while (done < n) {
+        // contiguous run of ring slots, read with one fread
+        const size_t y = reader->next + done,
+                     phase = y % reader->capacity;
+        size_t k = n - done;
+        if (k > reader->capacity - phase)
+            k = reader->capacity - phase;
+
+        // bottom up: top down rows y .. y + k - 1 are file rows (rows - y - k) .. (rows - y - 1).
+        //  The ring runs backwards for those (row y lives in slot capacity - 1 - phase) so
+        //  they are read in file order and nothing is ever reversed in memory.
+        const size_t file_row = bottom_up ? reader->rows - y - k : y,
+                     slot = bottom_up ? reader->capacity - phase - k : phase;
+        unsigned char* dst = reader->ring + slot * reader->stride;
+        if (fseeko(reader->read, (off_t)reader->hdr.file.bmp.BlobIndex + (off_t)(file_row * reader->stride), SEEK_SET)
+            || !fread_bmp_rows(reader->read, k, reader->row_bytes, reader->stride, dst, reader->stride))
+            break;
+
+        for (size_t i = 0; i < k; ++i)
+            rows[done + i] = dst + (bottom_up ? k - 1 - i : i) * reader->stride;
+        done += k;
+    }
+
+    reader->next += done;
+    return done;
+}
+
+void bmp_rows_close(BMP_ROW_READER* reader) {
+    free(reader->ring);
+    reader->ring = NULL;
+}
+
+// ===                              ===
+// ===     Banded parallel decode   ===
+// ===                              ===
+//  Uncompressed rows sit at fixed offsets (BlobIndex + row * stride), so the pixel array
+//  splits into bands of rows that are read with pread on one shared fd, and converted,
+//  independently.
+
+// bytes per band, enough to keep each pread well above syscall overhead
+#define BAND_BYTES (1U << 20)
+
+static bool pread_all(int fd, void* buf, size_t cb, off_t offset) {
+    unsigned char* p = buf;
+    while (cb) {
+        ssize_t done = pread(fd, p, cb, offset);
+        if (done < 0) {
+            if (EINTR == errno)
+                continue;
+            return false;
+        }
+        if (!done)
+            return errno = EIO, false;
+        p += done, cb -= (size_t)done, offset += done;
+    }
+    return true;
+}
+
+// headers and color table of the bitmap behind fd
+static bool pread_bmp_headers(int fd, UNSERIAL_BITMAP* out) {
+
+    unsigned char hdr[CB_SERIALIZED_BITMAPHEADERS_MAX];
+    ssize_t cb = pread(fd, hdr, sizeof(hdr), 0);
+    if ((cb < 0) || !decode_bmp_headers(hdr, (size_t)cb, out))
+        return false;
+    switch (out->info.bmp3.Compression) {
+        case BMP_COMPRESSION_NONE:
+        case BMP_COMPRESSION_BITFIELDS:
+        break;
+        default:
+            return errno = ENOTSUP, false;
+    }
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && ((uint64_t)st.st_size < bmp_pixel_array_end(out)))
+        return errno = EIO, false;
+
+    size_t offset;
+    const size_t count = bmp_palette_extent(out, &offset);
+    if (count) {
+        if (!(out->palette.array = bmp_alloc(out->allocator, count * sizeof(RGBQUAD))))
+            return errno = ENOMEM, false;
+        if (!pread_all(fd, out->palette.array, count * bmp_palette_entry_bytes(out), (off_t)offset)) {
+            bmp_free(out->allocator, out->palette.array);
+            out->palette.array = NULL;
+            return false;
+        }
+        bmp_palette_widen(out, out->palette.array, count);
+        out->palette.count = count;
+    }
+    return true;
+}
+
+typedef struct {
+    int fd;                         // -1 when converting from in->blob
+    const UNSERIAL_BITMAP* in;
+    const BMP_CONVERTER* cv;        // NULL: raw read into blob
+    unsigned char* blob;            // raw read destination, stride apart
+    unsigned char* dst;
+    size_t dst_stride;
+    bool flip;
+    size_t rows, row_bytes, stride, band_rows;
+} BAND_DECODE;
+
+static bool band_decode_job(void* ctx, size_t band, void** scratch) {
+
+    const BAND_DECODE* bd = ctx;
+    const size_t first = band * bd->band_rows,
+                 n = (bd->rows - first < bd->band_rows) ? bd->rows - first : bd->band_rows,
+                 cb = (n - 1) * bd->stride + bd->row_bytes;
+    const off_t offset = (off_t)bd->in->file.bmp.BlobIndex + (off_t)(first * bd->stride);
+
+    if (!bd->cv)
+        return pread_all(bd->fd, bd->blob + first * bd->stride, cb, offset);
+
+    const unsigned char* rows;
+    if (bd->fd < 0)
+        rows = bd->in->blob + first * bd->in->stride;
+    else {
+        if (!*scratch && !(*scratch = malloc(bd->band_rows * bd->stride)))
+            return errno = ENOMEM, false;
+        if (!pread_all(bd->fd, *scratch, cb, offset))
+            return false;
+        rows = *scratch;
+    }
+
+    const size_t src_stride = (bd->fd < 0) ? bd->in->stride : bd->stride,
+                 width = (size_t)abs(bd->in->info.bmp3.Width);
+    for (size_t i = 0; i < n; ++i) {
+        const size_t y = first + i, out_row = bd->flip ? bd->rows - 1 - y : y;
+        bd->cv->row(bd->cv, rows + i * src_stride, bd->dst + out_row * bd->dst_stride, width);
+    }
+    return true;
+}
+
+static bool band_decode(BAND_DECODE* bd, unsigned workers) {
+
+    bd->rows = (size_t)abs(bd->in->info.bmp3.Height);
+    bd->row_bytes = bmp_row_bytes(bd->in);
+    bd->stride = bmp_row_stride(bd->in);
+    bd->band_rows = (bd->stride && (bd->stride < BAND_BYTES)) ? BAND_BYTES / bd->stride : 1;
+    if (!bd->rows || !bd->row_bytes)
+        return true;
+
+    const size_t bands = (bd->rows + bd->band_rows - 1) / bd->band_rows;
+    return !parallel_for(workers, bands, 1, band_decode_job, bd);
+}
+
+bool parse_bmp_parallel(int fd, UNSERIAL_BITMAP* out, unsigned workers) {
+
+    UNSERIAL_BITMAP work = {0};
+    parse_settings(&work, out);
+    if (!pread_bmp_headers(fd, &work))
+        return false;
+
+    const size_t stride = bmp_row_stride(&work), rows = (size_t)abs(work.info.bmp3.Height);
+    if (!check_parse_budget(&work, stride * rows + 1)) {
+        bmp_free(work.allocator, work.palette.array);
+        return false;
+    }
+    if (!(work.blob = bmp_alloc(work.allocator, stride * rows + 1))) {
+        bmp_free(work.allocator, work.palette.array);
+        return errno = ENOMEM, false;
+    }
+    work.stride = stride;
+
+    // bands land straight in blob, padding and all
+    BAND_DECODE bd = { .fd = fd, .in = &work, .blob = work.blob };
+    if (!band_decode(&bd, workers)) {
+        free_bmp(&work);
+        return false;
+    }
+
+    memcpy(out, &work, sizeof(UNSERIAL_BITMAP));
+    return true;
+}
+
+bool parse_bmp_convert_parallel(int fd, BMP_PIXEL_FORMAT format, bool top_down, void* dst, size_t dst_stride, unsigned workers, UNSERIAL_BITMAP* hdr) {
+
+    UNSERIAL_BITMAP work = {0};
+    if (hdr)
+        parse_settings(&work, hdr);
+    if (!pread_bmp_headers(fd, &work))
+        return false;
+    // the pixels go straight to dst, only the pixel budget applies
+    if (!check_parse_budget(&work, 0)) {
+        free_bmp(&work);
+        return false;
+    }
+
+    BMP_CONVERTER* cv = bmp_alloc(work.allocator, sizeof(BMP_CONVERTER));
+    bool ok = cv && bmp_converter_init(cv, &work, format);
+    if (ok) {
+        cv->plane_stride = dst_stride * (size_t)abs(work.info.bmp3.Height);
+        BAND_DECODE bd = { .fd = fd, .in = &work, .cv = cv, .dst = dst, .dst_stride = dst_stride,
+                           .flip = (work.info.bmp3.Height > 0) == top_down };
+        ok = band_decode(&bd, workers);
+    }
+    else if (!cv)
+        errno = ENOMEM;
+    bmp_free(work.allocator, cv);
+
+    if (ok && hdr) {
+        // header for the caller, pixels are in dst
+        memcpy(hdr, &work, sizeof(UNSERIAL_BITMAP));
+        return true;
+    }
+    free_bmp(&work);
+    return ok;
+}
+
+bool bmp_convert_parallel(const UNSERIAL_BITMAP* in, BMP_PIXEL_FORMAT format, bool top_down, void* dst, size_t dst_stride, unsigned workers) {
+
+    if (!in->blob)
+        return errno = EINVAL, false;
+
+    BMP_CONVERTER* cv = bmp_alloc(in->allocator, sizeof(BMP_CONVERTER));
+    if (!cv)
+        return errno = ENOMEM, false;
+    bool ok = bmp_converter_init(cv, in, format);
+    if (ok) {
+        cv->plane_stride = dst_stride * (size_t)abs(in->info.bmp3.Height);
+        BAND_DECODE bd = { .fd = -1, .in = in, .cv = cv, .dst = dst, .dst_stride = dst_stride,
+                           .flip = (in->info.bmp3.Height > 0) == top_down };
+        ok = band_decode(&bd, workers);
+    }
+    bmp_free(in->allocator, cv);
+    return ok;
+}
+
+// ===                              ===
+// ===          Bitfields           ===
+// ===                              ===
+
+static void bitfields_row_scalar(const BMP_BITFIELDS* bf, const unsigned char* src, unsigned char* rgba, size_t width) {
+
+    for (size_t i = 0; i < width; ++i, rgba += 4) {
+        const uint32_t px = (16 == bf->bpp) ? load_little_u16(src + i * 2) : load_little_u32(src + i * 4);
+        uint32_t out = bf->opaque;
+        for (unsigned c = 0; c < 4; ++c) {
+            const unsigned bits = bf->replicate[c];
+            uint32_t v = ((px & bf->mask[c]) >> bf->rshift[c]) << bf->lshift[c];
+            v |= v >> bits;
+            v |= v >> (bits * 2 > 8 ? 8 : bits * 2);
+            v |= v >> (bits * 4 > 8 ? 8 : bits * 4);
+            out |= v << (8 * c);
+        }
+        rgba[0] = (unsigned char)out;
+        rgba[1] = (unsigned char)(out >> 8);
+        rgba[2] = (unsigned char)(out >> 16);
+        rgba[3] = (unsigned char)(out >> 24);
+    }
+}
+
+#ifdef BMP_X86_DISPATCH
+// Per channel: isolate, align the top 8 bits, replicate narrow channels.
+//  Shift counts >= 32 zero a lane, same as the scalar clamp to 8 on values < 256.
+__attribute__((target("sse2")))
+static void bitfields_row_sse2(const BMP_BITFIELDS* bf, const unsigned char* src, unsigned char* rgba, size_t width) {
+
+    __m128i mask[4], rshift[4], lshift[4], rep[3][4];
+    for (unsigned c = 0; c < 4; ++c) {
+        const unsigned bits = bf->replicate[c];
+        mask[c] = _mm_set1_epi32((int)bf->mask[c]);
+        rshift[c] = _mm_cvtsi32_si128(bf->rshift[c]);
+        lshift[c] = _mm_cvtsi32_si128(bf->lshift[c]);
+        rep[0][c] = _mm_cvtsi32_si128((int)bits);
+        rep[1][c] = _mm_cvtsi32_si128((int)bits * 2);
+        rep[2][c] = _mm_cvtsi32_si128((int)bits * 4);
+    }
+    const __m128i opaque = _mm_set1_epi32((int)bf->opaque), zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4) {
+        const __m128i px = (16 == bf->bpp)
+            ? _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(src + i * 2)), zero)
+            : _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i ch[4];
+        for (unsigned c = 0; c < 4; ++c) {
+            __m128i v = _mm_sll_epi32(_mm_srl_epi32(_mm_and_si128(px, mask[c]), rshift[c]), lshift[c]);
+            v = _mm_or_si128(v, _mm_srl_epi32(v, rep[0][c]));
+            v = _mm_or_si128(v, _mm_srl_epi32(v, rep[1][c]));
+            ch[c] = _mm_or_si128(v, _mm_srl_epi32(v, rep[2][c]));
+        }
+        __m128i out = _mm_or_si128(_mm_or_si128(opaque, ch[0]), _mm_slli_epi32(ch[1], 8));
+        out = _mm_or_si128(_mm_or_si128(out, _mm_slli_epi32(ch[2], 16)), _mm_slli_epi32(ch[3], 24));
+        _mm_storeu_si128((__m128i*)(rgba + i * 4), out);
+    }
+    bitfields_row_scalar(bf, src + i * (bf->bpp / CHAR_BIT), rgba + i * 4, width - i);
+}
+
+__attribute__((target("avx2")))
+static void bitfields_row_avx2(const BMP_BITFIELDS* bf, const unsigned char* src, unsigned char* rgba, size_t width) {
+
+    __m256i mask[4];
+    __m128i rshift[4], lshift[4], rep[3][4];
+    for (unsigned c = 0; c < 4; ++c) {
+        const unsigned bits = bf->replicate[c];
+        mask[c] = _mm256_set1_epi32((int)bf->mask[c]);
+        rshift[c] = _mm_cvtsi32_si128(bf->rshift[c]);
+        lshift[c] = _mm_cvtsi32_si128(bf->lshift[c]);
+        rep[0][c] = _mm_cvtsi32_si128((int)bits);
+        rep[1][c] = _mm_cvtsi32_si128((int)bits * 2);
+        rep[2][c] = _mm_cvtsi32_si128((int)bits * 4);
+    }
+    const __m256i opaque = _mm256_set1_epi32((int)bf->opaque);
+
+    size_t i = 0;
+    for (; i + 8 <= width; i += 8) {
+        const __m256i px = (16 == bf->bpp)
+            ? _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i * 2)))
+            : _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i ch[4];
+        for (unsigned c = 0; c < 4; ++c) {
+            __m256i v = _mm256_sll_epi32(_mm256_srl_epi32(_mm256_and_si256(px, mask[c]), rshift[c]), lshift[c]);
+            v = _mm256_or_si256(v, _mm256_srl_epi32(v, rep[0][c]));
+            v = _mm256_or_si256(v, _mm256_srl_epi32(v, rep[1][c]));
+            ch[c] = _mm256_or_si256(v, _mm256_srl_epi32(v, rep[2][c]));
+        }
+        __m256i out = _mm256_or_si256(_mm256_or_si256(opaque, ch[0]), _mm256_slli_epi32(ch[1], 8));
+        out = _mm256_or_si256(_mm256_or_si256(out, _mm256_slli_epi32(ch[2], 16)), _mm256_slli_epi32(ch[3], 24));
+        _mm256_storeu_si256((__m256i*)(rgba + i * 4), out);
+    }
+    bitfields_row_scalar(bf, src + i * (bf->bpp / CHAR_BIT), rgba + i * 4, width - i);
+}
+#endif // BMP_X86_DISPATCH
+
+// lowest set bit and width of a contiguous mask
+static bool bitfield_span(uint32_t mask, unsigned* shift, unsigned* bits) {
+    *shift = *bits = 0;
+    if (!mask)
+        return true;
+    while (!(mask & 1))
+        mask >>= 1, ++*shift;
+    while (mask & 1)
+        mask >>= 1, ++*bits;
+    return !mask;
+}
+
+bool bmp_bitfields_init(BMP_BITFIELDS* bf, const UNSERIAL_BITMAP* hdr) {
+
+    BMP_BITFIELDS work = {0};
+    work.bpp = hdr->info.bmp3.BitCount;
+    if ((16 != work.bpp) && (32 != work.bpp))
+        return errno = EINVAL, false;
+
+    if (BMP_COMPRESSION_BITFIELDS == hdr->info.bmp3.Compression) {
+        work.mask[0] = hdr->info.bmp3_nt.RedMask;
+        work.mask[1] = hdr->info.bmp3_nt.GreenMask;
+        work.mask[2] = hdr->info.bmp3_nt.BlueMask;
+        if (hdr->info.hdrsize >= CB_SERIALIZED_BITMAPV4INFOHEADER)
+            work.mask[3] = hdr->info.bmp4.AlphaMask;
+    }
+    else if (16 == work.bpp) {
+        work.mask[0] = 0x7C00, work.mask[1] = 0x03E0, work.mask[2] = 0x001F;
+    }
+    else {
+        // the high byte is unused, not alpha, in uncompressed files
+        work.mask[0] = 0x00FF0000, work.mask[1] = 0x0000FF00, work.mask[2] = 0x000000FF;
+    }
+
+    for (unsigned c = 0; c < 4; ++c) {
+        unsigned shift, bits;
+        if (!bitfield_span(work.mask[c], &shift, &bits) || (shift + bits > work.bpp))
+            return errno = EBADF, false;
+        if (shift + bits >= 8)
+            work.rshift[c] = (uint8_t)(shift + bits - 8);
+        else work.lshift[c] = (uint8_t)(8 - bits - shift);
+        work.replicate[c] = (uint8_t)((bits > 8) ? 8 : bits);
+    }
+    work.opaque = work.mask[3] ? 0 : 0xFF000000U;
+
+    work.row = bitfields_row_scalar;
+#ifdef BMP_X86_DISPATCH
+    const unsigned isa = cpu_isa();
+    if (isa & ISA_AVX2)
+        work.row = bitfields_row_avx2;
+    else if (isa & ISA_SSE2)
+        work.row = bitfields_row_sse2;
+#endif
+
+    memcpy(bf, &work, sizeof(BMP_BITFIELDS));
+    return true;
+}
+
+void bmp_bitfields_row(const BMP_BITFIELDS* bf, const unsigned char* src, unsigned char* rgba, size_t width) {
+    bf->row(bf, src, rgba, width);
+}
+
+// ===                              ===
+// ===           Palette            ===
+// ===                              ===
+
+// 1 / 2 / 4bpp: every source byte is a straight copy of its precomputed pixels
+static void palette_row_bytes(const BMP_PALETTE_LUT* lut, const unsigned char* src, unsigned char* dst, size_t width) {
+
+    const size_t per_byte = CHAR_BIT / lut->bpp, cbout = per_byte * lut->channels;
+    size_t i = 0;
+    for (; i + per_byte <= width; i += per_byte, dst += cbout)
+        memcpy(dst, lut->expand + (size_t)*src++ * cbout, cbout);
+    if (i < width)
+        memcpy(dst, lut->expand + (size_t)*src * cbout, (width - i) * lut->channels);
+}
+
+static void palette_row8_rgba(const BMP_PALETTE_LUT* lut, const unsigned char* src, unsigned char* dst, size_t width) {
+    for (size_t i = 0; i < width; ++i, dst += 4)
+        memcpy(dst, &lut->color[src[i]], 4);
+}
+
+static void palette_row8_rgb(const BMP_PALETTE_LUT* lut, const unsigned char* src, unsigned char* dst, size_t width) {
+    // 4 byte stores overlapping by one, the last pixel can't spill past the row
+    size_t i = 0;
+    for (; i + 1 < width; ++i, dst += 3)
+        memcpy(dst, &lut->color[src[i]], 4);
+    if (i < width)
+        memcpy(dst, &lut->color[src[i]], 3);
+}
+
+#ifdef BMP_X86_DISPATCH
+__attribute__((target("avx2")))
+static void palette_row8_rgba_avx2(const BMP_PALETTE_LUT* lut, const unsigned char* src, unsigned char* dst, size_t width) {
+    size_t i = 0;
+    for (; i + 8 <= width; i += 8) {
+        const __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_i32gather_epi32((const int*)lut->color, idx, 4));
+    }
+    palette_row8_rgba(lut, src + i, dst + i * 4, width - i);
+}
+
+// 16 pixels a gather; the row's last few go through the same gather, masked
+__attribute__((target("avx512f,avx512bw")))
+static void palette_row8_rgba_avx512(const BMP_PALETTE_LUT* lut, const unsigned char* src, unsigned char* dst, size_t width) {
+    for (size_t i = 0; i < width; i += 16) {
+        const size_t n = (width - i < 16) ? width - i : 16;
+        const __mmask16 live = (__mmask16)((1U << n) - 1);
+        const __m512i idx = _mm512_cvtepu8_epi32(_mm512_castsi512_si128(_mm512_maskz_loadu_epi8(live, src + i)));
+        _mm512_mask_storeu_epi32(dst + i * 4, live, _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), live, idx, (const int*)lut->color, 4));
+    }
+}
+#endif
+
+// DDB indices were into the display's palette of the day. Monochrome ones are black and
+//  white, 4bpp ones take the 16 color system palette, 8bpp ones are read as gray levels.
+static const unsigned char ddb_palette4[16][3] = {
+    { 0x00, 0x00, 0x00 }, { 0x80, 0x00, 0x00 }, { 0x00, 0x80, 0x00 }, { 0x80, 0x80, 0x00 },
+    { 0x00, 0x00, 0x80 }, { 0x80, 0x00, 0x80 }, { 0x00, 0x80, 0x80 }, { 0xC0, 0xC0, 0xC0 },
+    { 0x80, 0x80, 0x80 }, { 0xFF, 0x00, 0x00 }, { 0x00, 0xFF, 0x00 }, { 0xFF, 0xFF, 0x00 },
+    { 0x00, 0x00, 0xFF }, { 0xFF, 0x00, 0xFF }, { 0x00, 0xFF, 0xFF }, { 0xFF, 0xFF, 0xFF },
+};
+
+static void ddb_color(unsigned bpp, size_t i, unsigned char* c) {
+    switch (bpp) {
+        case 1:
+            c[0] = c[1] = c[2] = i ? 0xFF : 0x00;
+        break;
+        case 4:
+            memcpy(c, ddb_palette4[i & 15], 3);
+        break;
+        default:
+            c[0] = c[1] = c[2] = (unsigned char)i;
+        break;
+    }
+}
+
+bool bmp_palette_init(BMP_PALETTE_LUT* lut, const UNSERIAL_BITMAP* hdr, unsigned channels) {
+
+    const unsigned bpp = hdr->info.bmp3.BitCount;
+    if (((1 != bpp) && (2 != bpp) && (4 != bpp) && (8 != bpp)) || ((3 != channels) && (4 != channels)))
+        return errno = EINVAL, false;
+
+    lut->bpp = bpp;
+    lut->channels = channels;
+    memset(lut->color, 0, sizeof(lut->color));
+    const bool ddb = bmp_is_ddb(hdr);
+    for (size_t i = 0; i < 256; ++i) {
+        unsigned char* c = (unsigned char*)&lut->color[i];
+        if (ddb)
+            ddb_color(bpp, i, c);
+        else if (i < hdr->palette.count) {
+            c[0] = hdr->palette.array[i].rgbRed;
+            c[1] = hdr->palette.array[i].rgbGreen;
+            c[2] = hdr->palette.array[i].rgbBlue;
+        }
+        c[3] = 0xFF;
+    }
+
+    if (8 == bpp) {
+        lut->row = (4 == channels) ? palette_row8_rgba : palette_row8_rgb;
+#ifdef BMP_X86_DISPATCH
+        const unsigned isa = cpu_isa();
+        if ((4 == channels) && (isa & ISA_AVX512))
+            lut->row = palette_row8_rgba_avx512;
+        else if ((4 == channels) && (isa & ISA_AVX2))
+            lut->row = palette_row8_rgba_avx2;
+#endif
+        return true;
+    }
+
+    // most significant bits hold the leftmost pixel
+    const unsigned per_byte = CHAR_BIT / bpp, index_mask = (1U << bpp) - 1;
+    for (unsigned b = 0; b < 256; ++b) {
+        unsigned char* o = lut->expand + (size_t)b * per_byte * channels;
+        for (unsigned k = 0; k < per_byte; ++k, o += channels)
+            memcpy(o, &lut->color[(b >> (CHAR_BIT - bpp * (k + 1))) & index_mask], channels);
+    }
+    lut->row = palette_row_bytes;
+    return true;
+}
+
+void bmp_palette_row(const BMP_PALETTE_LUT* lut, const unsigned char* src, unsigned char* dst, size_t width) {
+    lut->row(lut, src, dst, width);
+}
+
+// ===                              ===
+// ===          Conversion          ===
+// ===                              ===
+
+// Staged conversions go through this many RGBA8 pixels at a time on the stack. A multiple
+//  of 8 keeps chunks of sub-byte sources byte aligned.
+#define CONVERT_CHUNK 64
+
+// BT.601 luma with weights summing to 128, shared by the scalar and SIMD kernels
+#define GRAY_R 38
+#define GRAY_G 75
+#define GRAY_B 15
+#define GRAY8(R, G, B) ((unsigned char)((GRAY_R * (R) + GRAY_G * (G) + GRAY_B * (B) + 64) >> 7))
+
+// c * a / 255, rounded to nearest for any 8 bit c and a
+static inline unsigned char premultiply(unsigned c, unsigned a) {
+    const unsigned x = c * a + 128;
+    return (unsigned char)((x + (x >> 8)) >> 8);
+}
+
+static inline bool format_premultiplied(BMP_PIXEL_FORMAT format) {
+    return (BMP_FORMAT_RGBA8_PREMULTIPLIED == format) || (BMP_FORMAT_BGRA8_PREMULTIPLIED == format);
+}
+
+// the same layout with straight alpha
+static inline BMP_PIXEL_FORMAT format_straight(BMP_PIXEL_FORMAT format) {
+    if (BMP_FORMAT_RGBA8_PREMULTIPLIED == format)
+        return BMP_FORMAT_RGBA8;
+    if (BMP_FORMAT_BGRA8_PREMULTIPLIED == format)
+        return BMP_FORMAT_BGRA8;
+    return format;
+}
+
+// Premultiplied RGBA8 back to straight alpha, in place. Colors a little over their alpha
+//  (from rounding while averaging) saturate.
+static void unpremultiply_rgba(unsigned char* rgba, size_t width) {
+    for (size_t i = 0; i < width; ++i, rgba += 4) {
+        const unsigned a = rgba[3];
+        if (0xFF == a)
+            continue;
+        for (unsigned c = 0; c < 3; ++c) {
+            const unsigned v = a ? (rgba[c] * 255U + a / 2) / a : 0;
+            rgba[c] = (unsigned char)((v > 0xFF) ? 0xFF : v);
+        }
+    }
+}
+
+size_t bmp_format_bytes(BMP_PIXEL_FORMAT format) {
+    switch (format) {
+        case BMP_FORMAT_RGBA8:
+        case BMP_FORMAT_BGRA8:
+        case BMP_FORMAT_RGBA8_PREMULTIPLIED:
+        case BMP_FORMAT_BGRA8_PREMULTIPLIED:
+            return 4;
+        case BMP_FORMAT_RGB8:
+            return 3;
+        case BMP_FORMAT_GRAY8:
+            return 1;
+        case BMP_FORMAT_PLANAR_F32:
+            return sizeof(float);
+    }
+    return 0;
+}
+
+// RGBA8 -> format, the second half of a staged conversion
+static void rgba_to_format(BMP_PIXEL_FORMAT format, size_t plane_stride, const unsigned char* rgba, unsigned char* dst, size_t width) {
+
+    switch (format) {
+        case BMP_FORMAT_RGBA8:
+            memcpy(dst, rgba, width * 4);
+        break;
+        case BMP_FORMAT_BGRA8:
+            for (size_t i = 0; i < width; ++i, rgba += 4, dst += 4)
+                dst[0] = rgba[2], dst[1] = rgba[1], dst[2] = rgba[0], dst[3] = rgba[3];
+        break;
+        case BMP_FORMAT_RGBA8_PREMULTIPLIED:
+            for (size_t i = 0; i < width; ++i, rgba += 4, dst += 4) {
+                const unsigned a = rgba[3];
+                dst[0] = premultiply(rgba[0], a), dst[1] = premultiply(rgba[1], a), dst[2] = premultiply(rgba[2], a), dst[3] = (unsigned char)a;
+            }
+        break;
+        case BMP_FORMAT_BGRA8_PREMULTIPLIED:
+            for (size_t i = 0; i < width; ++i, rgba += 4, dst += 4) {
+                const unsigned a = rgba[3];
+                dst[0] = premultiply(rgba[2], a), dst[1] = premultiply(rgba[1], a), dst[2] = premultiply(rgba[0], a), dst[3] = (unsigned char)a;
+            }
+        break;
+        case BMP_FORMAT_RGB8:
+            for (size_t i = 0; i < width; ++i, rgba += 4, dst += 3)
+                dst[0] = rgba[0], dst[1] = rgba[1], dst[2] = rgba[2];
+        break;
+        case BMP_FORMAT_GRAY8:
+            for (size_t i = 0; i < width; ++i, rgba += 4)
+                dst[i] = GRAY8(rgba[0], rgba[1], rgba[2]);
+        break;
+        case BMP_FORMAT_PLANAR_F32: {
+            float* r = (float*)dst;
+            float* g = (float*)(dst + plane_stride);
+            float* b = (float*)(dst + plane_stride * 2);
+            for (size_t i = 0; i < width; ++i, rgba += 4) {
+                r[i] = rgba[0] * (1.0f / 255.0f);
+                g[i] = rgba[1] * (1.0f / 255.0f);
+                b[i] = rgba[2] * (1.0f / 255.0f);
+            }
+        }
+        break;
+    }
+}
+
+static void convert_row_staged(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+
+    unsigned char rgba[CONVERT_CHUNK * 4];
+    const size_t cbout = bmp_format_bytes(cv->format),
+                 cbin = CONVERT_CHUNK * cv->bpp / CHAR_BIT;
+    for (size_t i = 0; i < width; i += CONVERT_CHUNK, src += cbin, dst += CONVERT_CHUNK * cbout) {
+        const size_t n = (width - i < CONVERT_CHUNK) ? width - i : CONVERT_CHUNK;
+        cv->stage(cv, src, rgba, n);
+        rgba_to_format(cv->format, cv->plane_stride, rgba, dst, n);
+    }
+}
+
+static void bgr_to_rgba(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    for (size_t i = 0; i < width; ++i, src += 3, dst += 4)
+        dst[0] = src[2], dst[1] = src[1], dst[2] = src[0], dst[3] = 0xFF;
+}
+
+static void bgr_to_bgra(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    for (size_t i = 0; i < width; ++i, src += 3, dst += 4)
+        dst[0] = src[0], dst[1] = src[1], dst[2] = src[2], dst[3] = 0xFF;
+}
+
+static void bgr_to_rgb(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    for (size_t i = 0; i < width; ++i, src += 3, dst += 3)
+        dst[0] = src[2], dst[1] = src[1], dst[2] = src[0];
+}
+
+static void bgr_to_gray(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    for (size_t i = 0; i < width; ++i, src += 3)
+        dst[i] = GRAY8(src[2], src[1], src[0]);
+}
+
+static void palette_direct(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    cv->source.palette.row(&cv->source.palette, src, dst, width);
+}
+
+static void bitfields_direct(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    cv->source.bitfields.row(&cv->source.bitfields, src, dst, width);
+}
+
+// --- 8-8-8-8 bitfields ---
+//  B G R A bytes in memory, the layout of screenshots and most 32bpp encoders, move as
+//  whole bytes rather than through the generic mask and shift. Without an alpha mask the
+//  fourth byte is ignored and comes out opaque; premultiplying is only asked for with one.
+static bool bitfields_bgra8888(const BMP_BITFIELDS* bf) {
+    return (32 == bf->bpp) && (0x00FF0000U == bf->mask[0]) && (0x0000FF00U == bf->mask[1])
+        && (0x000000FFU == bf->mask[2]) && (!bf->mask[3] || (0xFF000000U == bf->mask[3]));
+}
+
+static void bgra_to_bgra(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    const bool alpha = 0 != cv->source.bitfields.mask[3];
+    for (size_t i = 0; i < width; ++i, src += 4, dst += 4)
+        dst[0] = src[0], dst[1] = src[1], dst[2] = src[2], dst[3] = alpha ? src[3] : 0xFF;
+}
+
+static void bgra_to_rgba(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    const bool alpha = 0 != cv->source.bitfields.mask[3];
+    for (size_t i = 0; i < width; ++i, src += 4, dst += 4)
+        dst[0] = src[2], dst[1] = src[1], dst[2] = src[0], dst[3] = alpha ? src[3] : 0xFF;
+}
+
+static void bgra_to_bgra_premultiplied(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    for (size_t i = 0; i < width; ++i, src += 4, dst += 4) {
+        const unsigned a = src[3];
+        dst[0] = premultiply(src[0], a), dst[1] = premultiply(src[1], a), dst[2] = premultiply(src[2], a), dst[3] = (unsigned char)a;
+    }
+}
+
+static void bgra_to_rgba_premultiplied(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    for (size_t i = 0; i < width; ++i, src += 4, dst += 4) {
+        const unsigned a = src[3];
+        dst[0] = premultiply(src[2], a), dst[1] = premultiply(src[1], a), dst[2] = premultiply(src[0], a), dst[3] = (unsigned char)a;
+    }
+}
+
+#ifdef BMP_X86_DISPATCH
+// swaps bytes 0 and 2 of every pixel: B G R A <-> R G B A
+__attribute__((target("sse2")))
+static inline __m128i swap_rb_sse2(__m128i px) {
+    const __m128i rb_mask = _mm_set1_epi32(0x00FF00FF), rb = _mm_and_si128(px, rb_mask);
+    return _mm_or_si128(_mm_andnot_si128(rb_mask, px), _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16)));
+}
+
+// four pixels with their colors multiplied by their alpha, rounded as premultiply() does
+__attribute__((target("sse2")))
+static inline __m128i premultiply_sse2(__m128i px) {
+    const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(128), alpha = _mm_set1_epi32((int)0xFF000000U);
+    __m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+    const __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF),
+                  ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+    lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), half);
+    hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), half);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    // alpha itself stays as it was
+    return _mm_or_si128(_mm_andnot_si128(alpha, _mm_packus_epi16(lo, hi)), _mm_and_si128(alpha, px));
+}
+
+__attribute__((target("sse2")))
+static void bgra_to_bgra_sse2(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    const __m128i keep = _mm_set1_epi32((int)(0x00FFFFFFU | cv->source.bitfields.mask[3])),
+                  opaque = _mm_set1_epi32((int)cv->source.bitfields.opaque);
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4)
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i * 4)), keep), opaque));
+    bgra_to_bgra(cv, src + i * 4, dst + i * 4, width - i);
+}
+
+__attribute__((target("sse2")))
+static void bgra_to_rgba_sse2(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    const __m128i keep = _mm_set1_epi32((int)(0x00FFFFFFU | cv->source.bitfields.mask[3])),
+                  opaque = _mm_set1_epi32((int)cv->source.bitfields.opaque);
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4) {
+        const __m128i px = _mm_or_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i * 4)), keep), opaque);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), swap_rb_sse2(px));
+    }
+    bgra_to_rgba(cv, src + i * 4, dst + i * 4, width - i);
+}
+
+__attribute__((target("sse2")))
+static void bgra_to_bgra_premultiplied_sse2(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4)
+        _mm_storeu_si128((__m128i*)(dst + i * 4), premultiply_sse2(_mm_loadu_si128((const __m128i*)(src + i * 4))));
+    bgra_to_bgra_premultiplied(cv, src + i * 4, dst + i * 4, width - i);
+}
+
+__attribute__((target("sse2")))
+static void bgra_to_rgba_premultiplied_sse2(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    size_t i = 0;
+    for (; i + 4 <= width; i += 4)
+        _mm_storeu_si128((__m128i*)(dst + i * 4), swap_rb_sse2(premultiply_sse2(_mm_loadu_si128((const __m128i*)(src + i * 4)))));
+    bgra_to_rgba_premultiplied(cv, src + i * 4, dst + i * 4, width - i);
+}
+#endif // BMP_X86_DISPATCH
+
+#ifdef BMP_X86_DISPATCH
+// 16 pixels a round: four 16 byte loads 12 bytes apart, each shuffled from 4 BGR to 4 RGBX
+__attribute__((target("ssse3")))
+static void bgr_to_rgba_ssse3(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1),
+                  alpha = _mm_set1_epi32((int)0xFF000000U);
+    size_t i = 0;
+    // the last load reads 4 bytes past its pixels, keep it inside the row
+    for (; i + 18 <= width; i += 16, src += 48, dst += 64) {
+        _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), shuffle), alpha));
+        _mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 12)), shuffle), alpha));
+        _mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 24)), shuffle), alpha));
+        _mm_storeu_si128((__m128i*)(dst + 48), _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 36)), shuffle), alpha));
+    }
+    bgr_to_rgba(cv, src, dst, width - i);
+}
+
+// 8 pixels a round: BGR spread to 16-bit lanes B G R 0, multiply-add against the luma weights
+__attribute__((target("ssse3")))
+static void bgr_to_gray_ssse3(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+
+    const __m128i spread = _mm_setr_epi8(0, -1, 1, -1, 2, -1, -1, -1, 3, -1, 4, -1, 5, -1, -1, -1),
+                  weights = _mm_setr_epi16(GRAY_B, GRAY_G, GRAY_R, 0, GRAY_B, GRAY_G, GRAY_R, 0),
+                  round = _mm_set1_epi32(64);
+    size_t i = 0;
+    for (; i + 10 <= width; i += 8, src += 24) {
+        // pixels 0-1, 2-3, 4-5, 6-7
+        const __m128i lo = _mm_loadu_si128((const __m128i*)src), hi = _mm_loadu_si128((const __m128i*)(src + 12));
+        __m128i p01 = _mm_madd_epi16(_mm_shuffle_epi8(lo, spread), weights),
+                p23 = _mm_madd_epi16(_mm_shuffle_epi8(_mm_srli_si128(lo, 6), spread), weights),
+                p45 = _mm_madd_epi16(_mm_shuffle_epi8(hi, spread), weights),
+                p67 = _mm_madd_epi16(_mm_shuffle_epi8(_mm_srli_si128(hi, 6), spread), weights);
+        // B*w + G*w and R*w + 0 per pixel -> one sum per pixel
+        __m128i s0123 = _mm_add_epi32(_mm_unpacklo_epi64(_mm_shuffle_epi32(p01, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(p23, _MM_SHUFFLE(2, 0, 2, 0))),
+                                      _mm_unpacklo_epi64(_mm_shuffle_epi32(p01, _MM_SHUFFLE(3, 1, 3, 1)), _mm_shuffle_epi32(p23, _MM_SHUFFLE(3, 1, 3, 1))));
+        __m128i s4567 = _mm_add_epi32(_mm_unpacklo_epi64(_mm_shuffle_epi32(p45, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(p67, _MM_SHUFFLE(2, 0, 2, 0))),
+                                      _mm_unpacklo_epi64(_mm_shuffle_epi32(p45, _MM_SHUFFLE(3, 1, 3, 1)), _mm_shuffle_epi32(p67, _MM_SHUFFLE(3, 1, 3, 1))));
+        s0123 = _mm_srli_epi32(_mm_add_epi32(s0123, round), 7);
+        s4567 = _mm_srli_epi32(_mm_add_epi32(s4567, round), 7);
+        const __m128i g16 = _mm_packs_epi32(s0123, s4567);
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(g16, g16));
+    }
+    bgr_to_gray(cv, src, dst + i, width - i);
+}
+
+// 16 pixels a round from one 48 byte masked load: dwords spread so each 128 bit lane holds
+//  4 BGR pixels, then shuffled to RGBX as above. The mask covers the row's end too.
+__attribute__((target("avx512f,avx512bw")))
+static void bgr_to_rgba_avx512(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+
+    const __m512i spread = _mm512_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0),
+                  shuffle = _mm512_broadcast_i32x4(_mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)),
+                  alpha = _mm512_set1_epi32((int)0xFF000000U);
+    for (size_t i = 0; i < width; i += 16, src += 48, dst += 64) {
+        const size_t n = (width - i < 16) ? width - i : 16;
+        const __m512i px = _mm512_permutexvar_epi32(spread, _mm512_maskz_loadu_epi8(((__mmask64)1 << (3 * n)) - 1, src));
+        _mm512_mask_storeu_epi8(dst, (16 == n) ? ~(__mmask64)0 : ((__mmask64)1 << (4 * n)) - 1,
+            _mm512_or_si512(_mm512_shuffle_epi8(px, shuffle), alpha));
+    }
+}
+#endif // BMP_X86_DISPATCH
+
+#ifdef BMP_NEON
+// 16 pixels a round, deinterleaved into B, G, R planes and stored back interleaved as R G B A
+static void bgr_to_rgba_neon(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width) {
+    size_t i = 0;
+    for (; i + 16 <= width; i += 16, src += 48, dst += 64) {
+        const uint8x16x3_t bgr = vld3q_u8(src);
+        uint8x16x4_t rgba;
+        rgba.val[0] = bgr.val[2];
+        rgba.val[1] = bgr.val[1];
+        rgba.val[2] = bgr.val[0];
+        rgba.val[3] = vdupq_n_u8(0xFF);
+        vst4q_u8(dst, rgba);
+    }
+    bgr_to_rgba(cv, src, dst, width - i);
+}
+#endif
+
+// Source layouts the converter has direct kernels for
+typedef enum {
+    SOURCE_PALETTE,         // 1 / 2 / 4 / 8bpp indices
+    SOURCE_BGR24,
+    SOURCE_BGRA8888,        // 32bpp with byte aligned B G R (A) masks
+    SOURCE_BITFIELDS,       // any other masks, 16 / 32bpp uncompressed included
+} CONVERT_SOURCE;
+
+typedef void (*CONVERT_ROW)(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width);
+
+typedef struct {
+    CONVERT_SOURCE source;
+    BMP_PIXEL_FORMAT format;
+    unsigned isa;           // ISA_* the kernel needs, 0 for plain C
+    CONVERT_ROW row;
+} CONVERT_KERNEL;
+
+// Every direct kernel, fastest first within a source / format pair. Pairs missing here go
+//  through RGBA8 in chunks. Palette and mask sources bring their own per cpu kernels.
+static const CONVERT_KERNEL convert_kernels[] = {
+#ifdef BMP_X86_DISPATCH
+    { SOURCE_BGR24, BMP_FORMAT_RGBA8, ISA_AVX512, bgr_to_rgba_avx512 },
+    { SOURCE_BGR24, BMP_FORMAT_RGBA8, ISA_SSSE3, bgr_to_rgba_ssse3 },
+    { SOURCE_BGR24, BMP_FORMAT_GRAY8, ISA_SSSE3, bgr_to_gray_ssse3 },
+#endif
+#ifdef BMP_NEON
+    { SOURCE_BGR24, BMP_FORMAT_RGBA8, ISA_NEON, bgr_to_rgba_neon },
+#endif
+    { SOURCE_BGR24, BMP_FORMAT_RGBA8, 0, bgr_to_rgba },
+    { SOURCE_BGR24, BMP_FORMAT_BGRA8, 0, bgr_to_bgra },
+    { SOURCE_BGR24, BMP_FORMAT_RGB8, 0, bgr_to_rgb },
+    { SOURCE_BGR24, BMP_FORMAT_GRAY8, 0, bgr_to_gray },
+#ifdef BMP_X86_DISPATCH
+    { SOURCE_BGRA8888, BMP_FORMAT_RGBA8, ISA_SSE2, bgra_to_rgba_sse2 },
+    { SOURCE_BGRA8888, BMP_FORMAT_BGRA8, ISA_SSE2, bgra_to_bgra_sse2 },
+    { SOURCE_BGRA8888, BMP_FORMAT_RGBA8_PREMULTIPLIED, ISA_SSE2, bgra_to_rgba_premultiplied_sse2 },
+    { SOURCE_BGRA8888, BMP_FORMAT_BGRA8_PREMULTIPLIED, ISA_SSE2, bgra_to_bgra_premultiplied_sse2 },
+#endif
+    { SOURCE_BGRA8888, BMP_FORMAT_RGBA8, 0, bgra_to_rgba },
+    { SOURCE_BGRA8888, BMP_FORMAT_BGRA8, 0, bgra_to_bgra },
+    { SOURCE_BGRA8888, BMP_FORMAT_RGBA8_PREMULTIPLIED, 0, bgra_to_rgba_premultiplied },
+    { SOURCE_BGRA8888, BMP_FORMAT_BGRA8_PREMULTIPLIED, 0, bgra_to_bgra_premultiplied },
+    { SOURCE_PALETTE, BMP_FORMAT_RGBA8, 0, palette_direct },
+    { SOURCE_PALETTE, BMP_FORMAT_RGB8, 0, palette_direct },
+    { SOURCE_BITFIELDS, BMP_FORMAT_RGBA8, 0, bitfields_direct },
+};
+
+// The first kernel for source -> format that the cpu can run, NULL when there is none
+static CONVERT_ROW convert_kernel(CONVERT_SOURCE source, BMP_PIXEL_FORMAT format, unsigned isa) {
+    for (size_t i = 0; i < sizeof(convert_kernels) / sizeof(convert_kernels[0]); ++i) {
+        const CONVERT_KERNEL* k = &convert_kernels[i];
+        if ((source == k->source) && (format == k->format) && ((isa & k->isa) == k->isa))
+            return k->row;
+    }
+    return NULL;
+}
+
+bool bmp_converter_init(BMP_CONVERTER* cv, const UNSERIAL_BITMAP* hdr, BMP_PIXEL_FORMAT format) {
+
+    if (!bmp_format_bytes(format))
+        return errno = EINVAL, false;
+
+    cv->format = format;
+    cv->bpp = hdr->info.bmp3.BitCount;
+    cv->plane_stride = 0;
+
+    // only bitfields carry alpha; for everything else premultiplied output is the straight one
+    if ((16 != cv->bpp) && (32 != cv->bpp))
+        cv->format = format_straight(format);
+
+    CONVERT_SOURCE source;
+    switch (cv->bpp) {
+        case 1:
+        case 2:
+        case 4:
+        case 8:
+            if (!bmp_palette_init(&cv->source.palette, hdr, (BMP_FORMAT_RGB8 == format) ? 3 : 4))
+                return false;
+            source = SOURCE_PALETTE;
+        break;
+        case 16:
+        case 32:
+            if (!bmp_bitfields_init(&cv->source.bitfields, hdr))
+                return false;
+            if (!cv->source.bitfields.mask[3])
+                cv->format = format_straight(format);
+            source = bitfields_bgra8888(&cv->source.bitfields) ? SOURCE_BGRA8888 : SOURCE_BITFIELDS;
+        break;
+        case 24:
+            source = SOURCE_BGR24;
+        break;
+        default:
+            return errno = ENOTSUP, false;
+    }
+
+    // picked once per image; the staged path needs the source's RGBA8 kernel (every source
+    //  has one), a 3 channel palette only ever converts directly
+    const unsigned isa = cpu_isa();
+    cv->stage = convert_kernel(source, BMP_FORMAT_RGBA8, isa);
+    if (!(cv->row = convert_kernel(source, cv->format, isa)))
+        cv->row = convert_row_staged;
+    return true;
+}
+
+void bmp_convert_row(const BMP_CONVERTER* cv, const unsigned char* src, void* dst, size_t width) {
+    cv->row(cv, src, dst, width);
+}
+
+bool bmp_convert(const UNSERIAL_BITMAP* in, BMP_PIXEL_FORMAT format, bool top_down, void* dst, size_t dst_stride) {
+
+    BMP_CONVERTER* cv = bmp_alloc(in->allocator, sizeof(BMP_CONVERTER));
+    if (!cv)
+        return errno = ENOMEM, false;
+    if (!in->blob || !bmp_converter_init(cv, in, format)) {
+        bmp_free(in->allocator, cv);
+        return in->blob ? false : (errno = EINVAL, false);
+    }
+
+    const size_t width = (size_t)abs(in->info.bmp3.Width), rows = (size_t)abs(in->info.bmp3.Height);
+    cv->plane_stride = dst_stride * rows;
+
+    // blob is in file order; flip while converting if that isn't the order asked for
+    const bool flip = (in->info.bmp3.Height > 0) == top_down;
+    for (size_t y = 0; y < rows; ++y)
+        cv->row(cv, in->blob + (flip ? rows - 1 - y : y) * in->stride, (unsigned char*)dst + y * dst_stride, width);
+
+    bmp_free(in->allocator, cv);
+    return true;
+}
+
+// ===                              ===
+// ===           Decoder            ===
+// ===                              ===
+
+const char* bmp_status_string(BMP_STATUS status) {
+    switch (status) {
+        case BMP_OK:                return "ok";
+        case BMP_ERR_IO:            return "read failed or file truncated";
+        case BMP_ERR_MAGIC:         return "not a bitmap file";
+        case BMP_ERR_HEADER:        return "invalid header";
+        case BMP_ERR_UNSUPPORTED:   return "unsupported bitmap variant";
+        case BMP_ERR_LIMIT:         return "image exceeds decoder limits";
+        case BMP_ERR_NOMEM:         return "out of memory";
+        case BMP_ERR_CORRUPT:       return "corrupt pixel data";
+        case BMP_ERR_ARGUMENT:      return "invalid argument";
+    }
+    return "unknown status";
+}
+
+const char* bmp_stage_name(BMP_STAGE stage) {
+    switch (stage) {
+        case BMP_STAGE_HEADERS:     return "headers";
+        case BMP_STAGE_SETUP:       return "setup";
+        case BMP_STAGE_READ:        return "read";
+        case BMP_STAGE_RLE:         return "rle";
+        case BMP_STAGE_CONVERT:     return "convert";
+        case BMP_STAGE_SCALE:       return "scale";
+        case BMP_STAGE_COUNT:       break;
+    }
+    return "unknown stage";
+}
+
+void bmp_stats_merge(BMP_STATS* into, const BMP_STATS* from) {
+    for (size_t i = 0; i < BMP_STAGE_COUNT; ++i)
+        into->ns[i] += from->ns[i];
+    into->bytes_read += from->bytes_read;
+    into->reads += from->reads;
+    into->seeks += from->seeks;
+    into->allocations += from->allocations;
+    into->bytes_allocated += from->bytes_allocated;
+    into->decodes += from->decodes;
+    into->failures += from->failures;
+}
+
+// --- Instrumentation ---
+//  Stages are timed as laps: each boundary charges the time since the previous one to the
+//  stage that just ended. Without BMP_INSTRUMENT all of it compiles away.
+#ifdef BMP_INSTRUMENT
+static inline uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+static inline void stats_begin(BMP_DECODER* dec) {
+    dec->stage_start = stats_clock();
+}
+
+static inline void stats_stage(BMP_DECODER* dec, BMP_STAGE stage) {
+    const uint64_t now = stats_clock();
+    dec->stats.ns[stage] += now - dec->stage_start;
+    dec->stage_start = now;
+}
+
+#define STATS_ADD(STATS, FIELD, N) ((STATS)->FIELD += (uint64_t)(N))
+#else
+static inline void stats_begin(BMP_DECODER* dec) {}
+static inline void stats_stage(BMP_DECODER* dec, BMP_STAGE stage) {}
+#define STATS_ADD(STATS, FIELD, N) ((void)0)
+#endif
+
+// cb bytes of pixel data came in from the file
+static inline void stats_read(BMP_DECODER* dec, size_t cb) {
+    STATS_ADD(&dec->stats, reads, 1);
+    STATS_ADD(&dec->stats, bytes_read, cb);
+    stats_stage(dec, BMP_STAGE_READ);
+}
+
+// Records why a decode failed; errno carries err as well for callers that only look there
+static bool decoder_fail(BMP_DECODER* dec, BMP_STATUS status, int err) {
+    STATS_ADD(&dec->stats, failures, 1);
+    dec->status = status;
+    dec->error = err;
+    return errno = err, false;
+}
+
+// Grows a scratch buffer to at least cb bytes, charging them to the image's max_bytes
+//  budget whether or not the buffer already holds them. Contents are not kept.
+static bool decoder_reserve(BMP_DECODER* dec, BMP_DECODER_BUFFER* buf, size_t cb) {
+    if (dec->options.max_bytes && (cb > dec->options.max_bytes - dec->reserved))
+        return decoder_fail(dec, BMP_ERR_LIMIT, EFBIG);
+    dec->reserved += cb;
+    if (buf->size >= cb)
+        return true;
+    bmp_free(dec->allocator, buf->data);
+    buf->size = 0;
+    STATS_ADD(&dec->stats, allocations, 1);
+    STATS_ADD(&dec->stats, bytes_allocated, cb);
+    if (!(buf->data = bmp_alloc(dec->allocator, cb)))
+        return decoder_fail(dec, BMP_ERR_NOMEM, ENOMEM);
+    buf->size = cb;
+    return true;
+}
+
+bool bmp_decoder_init(BMP_DECODER* dec, const BMP_DECODE_OPTIONS* options, const BMP_ALLOCATOR* allocator) {
+
+    memset(dec, 0, sizeof(BMP_DECODER));
+    if (options)
+        dec->options = *options;
+    else dec->options.format = BMP_FORMAT_RGBA8, dec->options.top_down = true;
+    dec->allocator = allocator;
+    if (!bmp_format_bytes(dec->options.format))
+        return decoder_fail(dec, BMP_ERR_ARGUMENT, EINVAL);
+    return true;
+}
+
+void bmp_decoder_destroy(BMP_DECODER* dec) {
+    BMP_DECODER_BUFFER* buffers[] = { &dec->scratch, &dec->pixels, &dec->columns, &dec->scaler };
+    for (size_t i = 0; i < sizeof(buffers) / sizeof(*buffers); ++i) {
+        bmp_free(dec->allocator, buffers[i]->data);
+        buffers[i]->data = NULL;
+        buffers[i]->size = 0;
+    }
+}
+
+static inline bool decoder_rle(const BMP_DECODER* dec) {
+    return (BMP_COMPRESSION_RLE8 == dec->hdr.info.bmp3.Compression) || (BMP_COMPRESSION_RLE4 == dec->hdr.info.bmp3.Compression);
+}
+
+// Decodes and checks the headers in p, leaving dec->hdr ready for the color table
+static bool decoder_headers(BMP_DECODER* dec, const unsigned char* p, size_t cb) {
+
+    UNSERIAL_BITMAP* hdr = &dec->hdr;
+    memset(hdr, 0, sizeof(UNSERIAL_BITMAP));
+    hdr->allocator = dec->allocator;
+    dec->reserved = 0;
+
+    if (cb < 2)
+        return decoder_fail(dec, BMP_ERR_IO, EIO);
+    switch (load_little_u16(p)) {
+        case BMP_TYPE_MAGIC:
+        case DDB_TYPE_MAGIC:
+        break;
+        default:
+            return decoder_fail(dec, BMP_ERR_MAGIC, EBADF);
+    }
+    // validate_bmp_headers vets dimensions, depth and compression
+    if (!decode_bmp_headers(p, cb, hdr))
+        return decoder_fail(dec, (ENOTSUP == errno) ? BMP_ERR_UNSUPPORTED : (EFBIG == errno) ? BMP_ERR_LIMIT : BMP_ERR_HEADER, errno);
+    return true;
+}
+
+// Uncompressed images only: available bytes (of the file or buffer) must hold the whole
+//  pixel array, checked before any buffer is sized for it
+static bool decoder_check_extent(BMP_DECODER* dec, uint64_t available) {
+    if (!decoder_rle(dec) && (available < bmp_pixel_array_end(&dec->hdr)))
+        return decoder_fail(dec, BMP_ERR_IO, EIO);
+    return true;
+}
+
+// decoder_check_extent against the size of a regular file; pipes and the like are left
+//  for the reads to find short
+static bool decoder_check_file_extent(BMP_DECODER* dec, int fd) {
+    struct stat st;
+    return fstat(fd, &st) || !S_ISREG(st.st_mode) || decoder_check_extent(dec, (uint64_t)st.st_size);
+}
+
+// Checks the output size against the decoder's limits and lays out the image
+static bool decoder_output(BMP_DECODER* dec, size_t w, size_t h) {
+
+    if ((dec->options.max_width && (w > dec->options.max_width))
+        || (dec->options.max_height && (h > dec->options.max_height)))
+        return decoder_fail(dec, BMP_ERR_LIMIT, EFBIG);
+
+    // output buffer, planes stacked for planar formats
+    const size_t planes = (BMP_FORMAT_PLANAR_F32 == dec->options.format) ? 3 : 1,
+                 pixel = bmp_format_bytes(dec->options.format);
+    if ((w > SIZE_MAX / pixel) || (h > SIZE_MAX / planes / (w * pixel)))
+        return decoder_fail(dec, BMP_ERR_LIMIT, EFBIG);
+    dec->image.width = (uint32_t)w;
+    dec->image.height = (uint32_t)h;
+    dec->image.format = dec->options.format;
+    dec->image.stride = w * pixel;
+    dec->image.pixels = NULL;
+    return true;
+}
+
+// Picks the window to decode, the whole image when region is NULL
+static bool decoder_window(BMP_DECODER* dec, const BMP_REGION* region) {
+
+    const uint32_t width = (uint32_t)dec->hdr.info.bmp3.Width, height = (uint32_t)abs(dec->hdr.info.bmp3.Height);
+    if (region) {
+        if (!region->width || !region->height
+            || (region->x > width) || (region->width > width - region->x)
+            || (region->y > height) || (region->height > height - region->y))
+            return decoder_fail(dec, BMP_ERR_ARGUMENT, EINVAL);
+        dec->region = *region;
+    }
+    else {
+        dec->region.x = dec->region.y = 0;
+        dec->region.width = width;
+        dec->region.height = height;
+    }
+    if (dec->options.max_pixels && ((uint64_t)dec->region.width * dec->region.height > dec->options.max_pixels))
+        return decoder_fail(dec, BMP_ERR_LIMIT, EFBIG);
+    return true;
+}
+
+// Sets up the converter (to format) and the output buffer once the color table is in dec->hdr
+static bool decoder_prepare(BMP_DECODER* dec, BMP_PIXEL_FORMAT format) {
+
+    if (!bmp_converter_init(&dec->converter, &dec->hdr, format))
+        return decoder_fail(dec, BMP_ERR_UNSUPPORTED, errno);
+    const size_t plane = dec->image.stride * dec->image.height;
+    dec->converter.plane_stride = plane;
+    if (!decoder_reserve(dec, &dec->pixels, (BMP_FORMAT_PLANAR_F32 == dec->options.format) ? 3 * plane : plane))
+        return false;
+    // sub byte pixels that do not start on a byte boundary are realigned one row at a time
+    if ((dec->hdr.info.bmp3.BitCount < 8) && ((dec->region.x * dec->hdr.info.bmp3.BitCount) & 7)
+        && !decoder_reserve(dec, &dec->columns, ((size_t)dec->region.width * dec->hdr.info.bmp3.BitCount + 7) / 8))
+        return false;
+    dec->image.pixels = dec->pixels.data;
+    stats_stage(dec, BMP_STAGE_SETUP);
+    return true;
+}
+
+// First and one past the last byte of the window's columns within a row
+static inline void decoder_span(const BMP_DECODER* dec, size_t* first, size_t* last) {
+    const size_t bpp = dec->hdr.info.bmp3.BitCount;
+    *first = dec->region.x * bpp / 8;
+    *last = (((size_t)dec->region.x + dec->region.width) * bpp + 7) / 8;
+}
+
+// File rows holding the window: [first, first + region.height)
+static inline size_t decoder_first_file_row(const BMP_DECODER* dec) {
+    const size_t rows = (size_t)abs(dec->hdr.info.bmp3.Height);
+    return (dec->hdr.info.bmp3.Height > 0) ? rows - dec->region.y - dec->region.height : dec->region.y;
+}
+
+// --- Downscaling ---
+//  Area averaging fused with decoding: each source row is expanded to RGBA8, reduced
+//  horizontally, and weighted into the (at most two) output rows it overlaps. Overlaps are
+//  found in integer units where a source pixel is width (height) units wide and an output
+//  pixel src_width (src_height); the weights themselves are fractions of an output pixel,
+//  so sums stay within 0..255 and single precision is plenty.
+//  When both sides shrink by the same integer factor every source pixel lands in exactly
+//  one output pixel, and rows are box summed straight into 32 bit accumulators.
+
+// Output pixel: a partial first source pixel x, whole ones up to end and a partial pixel
+//  end, weights as fractions of the output pixel (last may be 0)
+typedef struct {
+    uint32_t x, end;
+    float first, last;
+} AREA_SPAN;
+
+typedef struct SCALER {
+    BMP_DECODER* dec;
+    size_t src_width, src_height;
+    size_t width, height;
+    unsigned factor;            // box factor, 0 for general area averaging
+    bool premultiplied;         // rows are averaged with premultiplied alpha
+    unsigned char* rgba;        // one source row, then one output row
+    float* hsum;                // general only: width * 4 horizontal averages,
+    uint32_t* prefix;           //  running sums of the source row, (src_width + 1) * 4
+    AREA_SPAN* spans;           //  and the source pixels under each output pixel
+    void* acc[2];               // vertical sums, alternating output rows: uint32_t for
+                                //  box factors, float otherwise
+    size_t acc_row[2];
+    uint64_t acc_weight[2];
+    // box kernels: adds the sums of each factor pixels of a row to acc / writes acc * scale
+    void (*reduce)(const unsigned char* rgba, uint32_t* acc, size_t width, unsigned factor);
+    void (*normalize)(const uint32_t* acc, unsigned char* rgba, size_t n, float scale);
+    // general kernels: rgba to hsum / acc += h * weight
+    void (*reduce_row)(const struct SCALER* sc);
+    void (*accumulate)(float* acc, const float* h, size_t n, float weight);
+} SCALER;
+
+static void reduce_box(const unsigned char* rgba, uint32_t* acc, size_t width, unsigned factor) {
+    for (size_t ox = 0; ox < width; ++ox, acc += 4) {
+        uint32_t r = 0, g = 0, b = 0, a = 0;
+        for (unsigned k = 0; k < factor; ++k, rgba += 4)
+            r += rgba[0], g += rgba[1], b += rgba[2], a += rgba[3];
+        acc[0] += r, acc[1] += g, acc[2] += b, acc[3] += a;
+    }
+}
+
+static void normalize_box(const uint32_t* acc, unsigned char* rgba, size_t n, float scale) {
+    for (size_t i = 0; i < n; ++i)
+        rgba[i] = (unsigned char)((float)(int32_t)acc[i] * scale + 0.5f);
+}
+
+// Whole pixels come out of running sums, so every output pixel costs the same whatever
+//  the ratio, with no data dependent branches
+static void reduce_area(const SCALER* sc) {
+
+    const unsigned char* p = sc->rgba;
+    uint32_t* prefix = sc->prefix;
+    uint32_t r = 0, g = 0, b = 0, a = 0;
+    prefix[0] = prefix[1] = prefix[2] = prefix[3] = 0;
+    for (size_t x = 0; x < sc->src_width; ++x, p += 4) {
+        r += p[0], g += p[1], b += p[2], a += p[3];
+        prefix[x * 4 + 4] = r, prefix[x * 4 + 5] = g, prefix[x * 4 + 6] = b, prefix[x * 4 + 7] = a;
+    }
+
+    const AREA_SPAN* span = sc->spans;
+    const unsigned char* rgba = sc->rgba;
+    const float unit = (float)sc->width / sc->src_width;
+    float* h = sc->hsum;
+    for (size_t ox = 0; ox < sc->width; ++ox, ++span, h += 4) {
+        // rgba has a zeroed pixel of slack for a last weight of 0 at the right edge
+        const unsigned char* first = rgba + (size_t)span->x * 4, *last = rgba + (size_t)span->end * 4;
+        const uint32_t* lo = prefix + (size_t)span->x * 4 + 4, *hi = prefix + (size_t)span->end * 4;
+        const float wfirst = span->first, wlast = span->last;
+        for (unsigned c = 0; c < 4; ++c)
+            h[c] = (float)(hi[c] - lo[c]) * unit + first[c] * wfirst + last[c] * wlast;
+    }
+}
+
+// General path, one output row: acc += h * weight
+static void accumulate_area(float* acc, const float* h, size_t n, float weight) {
+    for (size_t i = 0; i < n; ++i)
+        acc[i] += h[i] * weight;
+}
+
+#ifdef BMP_X86_DISPATCH
+// Box sums of 2, 4 or 8 pixels. Pixels are widened to 16 bits and folded together 64 bits
+//  at a time, then widened again and added to the accumulators.
+__attribute__((target("sse2")))
+static void reduce_box_sse2(const unsigned char* rgba, uint32_t* acc, size_t width, unsigned factor) {
+
+    const __m128i zero = _mm_setzero_si128();
+    size_t ox = 0;
+    switch (factor) {
+        case 2:
+            // 4 pixels in, 2 sums out
+            for (; ox + 2 <= width; ox += 2, rgba += 16, acc += 8) {
+                const __m128i v = _mm_loadu_si128((const __m128i*)rgba),
+                              p01 = _mm_unpacklo_epi8(v, zero), p23 = _mm_unpackhi_epi8(v, zero),
+                              s = _mm_add_epi16(_mm_unpacklo_epi64(p01, p23), _mm_unpackhi_epi64(p01, p23));
+                _mm_storeu_si128((__m128i*)acc, _mm_add_epi32(_mm_loadu_si128((const __m128i*)acc), _mm_unpacklo_epi16(s, zero)));
+                _mm_storeu_si128((__m128i*)(acc + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(acc + 4)), _mm_unpackhi_epi16(s, zero)));
+            }
+        break;
+        case 4:
+            for (; ox < width; ++ox, rgba += 16, acc += 4) {
+                const __m128i v = _mm_loadu_si128((const __m128i*)rgba),
+                              s = _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)),
+                              t = _mm_unpacklo_epi16(_mm_add_epi16(s, _mm_srli_si128(s, 8)), zero);
+                _mm_storeu_si128((__m128i*)acc, _mm_add_epi32(_mm_loadu_si128((const __m128i*)acc), t));
+            }
+        break;
+        case 8:
+            for (; ox < width; ++ox, rgba += 32, acc += 4) {
+                const __m128i v0 = _mm_loadu_si128((const __m128i*)rgba),
+                              v1 = _mm_loadu_si128((const __m128i*)(rgba + 16)),
+                              s = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(v0, zero), _mm_unpackhi_epi8(v0, zero)),
+                                                _mm_add_epi16(_mm_unpacklo_epi8(v1, zero), _mm_unpackhi_epi8(v1, zero))),
+                              t = _mm_unpacklo_epi16(_mm_add_epi16(s, _mm_srli_si128(s, 8)), zero);
+                _mm_storeu_si128((__m128i*)acc, _mm_add_epi32(_mm_loadu_si128((const __m128i*)acc), t));
+            }
+        break;
+    }
+    reduce_box(rgba, acc, width - ox, factor);
+}
+
+__attribute__((target("sse2")))
+static inline __m128 pixel_to_ps_sse2(const unsigned char* p) {
+    int32_t v;
+    memcpy(&v, p, 4);
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero));
+}
+
+// reduce_area with a pixel per register; differences of the running sums are converted as
+//  signed, so the source row must stay under 2^31 / 255 pixels
+__attribute__((target("sse2")))
+static void reduce_area_sse2(const SCALER* sc) {
+
+    const unsigned char* p = sc->rgba;
+    uint32_t* prefix = sc->prefix;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    _mm_storeu_si128((__m128i*)prefix, sum);
+    size_t x = 0;
+    for (; x + 4 <= sc->src_width; x += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(p + x * 4)),
+                      lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+        sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*)(prefix + x * 4 + 4), sum);
+        sum = _mm_add_epi32(sum, _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*)(prefix + x * 4 + 8), sum);
+        sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i*)(prefix + x * 4 + 12), sum);
+        sum = _mm_add_epi32(sum, _mm_unpackhi_epi16(hi, zero));
+        _mm_storeu_si128((__m128i*)(prefix + x * 4 + 16), sum);
+    }
+    for (; x < sc->src_width; ++x) {
+        int32_t v;
+        memcpy(&v, p + x * 4, 4);
+        sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero));
+        _mm_storeu_si128((__m128i*)(prefix + x * 4 + 4), sum);
+    }
+
+    const AREA_SPAN* span = sc->spans;
+    const __m128 unit = _mm_set1_ps((float)sc->width / sc->src_width);
+    float* h = sc->hsum;
+    for (size_t ox = 0; ox < sc->width; ++ox, ++span, h += 4) {
+        const __m128i whole = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(prefix + (size_t)span->end * 4)),
+            _mm_loadu_si128((const __m128i*)(prefix + (size_t)span->x * 4 + 4)));
+        __m128 r = _mm_mul_ps(_mm_cvtepi32_ps(whole), unit);
+        r = _mm_add_ps(r, _mm_mul_ps(pixel_to_ps_sse2(p + (size_t)span->x * 4), _mm_set1_ps(span->first)));
+        r = _mm_add_ps(r, _mm_mul_ps(pixel_to_ps_sse2(p + (size_t)span->end * 4), _mm_set1_ps(span->last)));
+        _mm_storeu_ps(h, r);
+    }
+}
+
+__attribute__((target("sse2")))
+static void accumulate_area_sse2(float* acc, const float* h, size_t n, float weight) {
+    const __m128 w = _mm_set1_ps(weight);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_loadu_ps(h + i), w)));
+    accumulate_area(acc + i, h + i, n - i, weight);
+}
+
+// 16 channels at a time: to float, scale, round to nearest and saturate back to bytes
+__attribute__((target("sse2")))
+static void normalize_box_sse2(const uint32_t* acc, unsigned char* rgba, size_t n, float scale) {
+
+    const __m128 s = _mm_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v[4];
+        for (unsigned k = 0; k < 4; ++k)
+            v[k] = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(acc + i + k * 4))), s));
+        _mm_storeu_si128((__m128i*)(rgba + i), _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3])));
+    }
+    normalize_box(acc + i, rgba + i, n - i, scale);
+}
+#endif
+
+// Output row acc_row[slot] is complete: normalize and convert it into place
+static void scaler_emit(SCALER* sc, unsigned slot) {
+
+    BMP_DECODER* dec = sc->dec;
+    const size_t n = sc->width * 4;
+    unsigned char* rgba = sc->rgba;
+    if (sc->factor)
+        sc->normalize(sc->acc[slot], rgba, n, 1.0f / ((float)sc->factor * sc->factor));
+    else {
+        const float* acc = sc->acc[slot];
+        for (size_t i = 0; i < n; ++i)
+            rgba[i] = (unsigned char)(acc[i] + 0.5f);
+    }
+
+    // averaged premultiplied so transparent pixels don't bleed their color; premultiplied
+    //  output takes them as they are
+    if (sc->premultiplied && !format_premultiplied(dec->options.format))
+        unpremultiply_rgba(rgba, sc->width);
+
+    const size_t oy = sc->acc_row[slot], y = dec->options.top_down ? oy : sc->height - 1 - oy;
+    rgba_to_format(format_straight(dec->options.format), dec->image.stride * dec->image.height, rgba,
+        dec->pixels.data + y * dec->image.stride, sc->width);
+    memset(sc->acc[slot], 0, n * (sc->factor ? sizeof(uint32_t) : sizeof(float)));
+    sc->acc_weight[slot] = 0;
+}
+
+static void scaler_add(SCALER* sc, size_t oy, uint64_t weight) {
+
+    const unsigned slot = oy & 1;
+    sc->accumulate(sc->acc[slot], sc->hsum, sc->width * 4, (float)weight / sc->src_height);
+    sc->acc_row[slot] = oy;
+    if ((sc->acc_weight[slot] += weight) == sc->src_height)
+        scaler_emit(sc, slot);
+}
+
+// Takes source row file_row (file order) through both passes
+static void scaler_row(SCALER* sc, const unsigned char* src, size_t file_row) {
+
+    BMP_DECODER* dec = sc->dec;
+    dec->converter.row(&dec->converter, src, sc->rgba, sc->src_width);
+    stats_stage(dec, BMP_STAGE_CONVERT);
+
+    // rows are placed in top-down order
+    const size_t ty = (dec->hdr.info.bmp3.Height > 0) ? sc->src_height - 1 - file_row : file_row;
+    if (sc->factor) {
+        const size_t oy = ty / sc->factor;
+        const unsigned slot = oy & 1;
+        sc->reduce(sc->rgba, sc->acc[slot], sc->width, sc->factor);
+        sc->acc_row[slot] = oy;
+        if (++sc->acc_weight[slot] == sc->factor)
+            scaler_emit(sc, slot);
+        stats_stage(dec, BMP_STAGE_SCALE);
+        return;
+    }
+
+    sc->reduce_row(sc);
+    const uint64_t start = (uint64_t)ty * sc->height, end = start + sc->height,
+                   oy = start / sc->src_height, split = (oy + 1) * sc->src_height;
+    if (end <= split)
+        scaler_add(sc, (size_t)oy, sc->height);
+    else {
+        scaler_add(sc, (size_t)oy, split - start);
+        scaler_add(sc, (size_t)oy + 1, end - split);
+    }
+    stats_stage(dec, BMP_STAGE_SCALE);
+}
+
+// Lays out the scaler in dec->scaler for the window and output size, and picks the kernels
+static bool scaler_init(SCALER* sc, BMP_DECODER* dec) {
+
+    memset(sc, 0, sizeof(SCALER));
+    sc->dec = dec;
+    sc->src_width = dec->region.width;
+    sc->src_height = dec->region.height;
+    sc->width = dec->image.width;
+    sc->height = dec->image.height;
+    sc->premultiplied = format_premultiplied(dec->converter.format);
+    // box sums of up to 2048 x 2048 pixels fit 32 bits
+    if ((sc->src_width % sc->width == 0) && (sc->src_height % sc->height == 0)
+        && (sc->src_width / sc->width == sc->src_height / sc->height) && (sc->src_width / sc->width <= 2048)) {
+        sc->factor = (unsigned)(sc->src_width / sc->width);
+    }
+    sc->reduce = reduce_box;
+    sc->normalize = normalize_box;
+    sc->reduce_row = reduce_area;
+    sc->accumulate = accumulate_area;
+#ifdef BMP_X86_DISPATCH
+    if (cpu_isa() & ISA_SSE2) {
+        if ((2 == sc->factor) || (4 == sc->factor) || (8 == sc->factor))
+            sc->reduce = reduce_box_sse2;
+        sc->normalize = normalize_box_sse2;
+        sc->accumulate = accumulate_area_sse2;
+        if (sc->src_width < INT32_MAX / 255)
+            sc->reduce_row = reduce_area_sse2;
+    }
+#endif
+
+    const size_t cbrgba = (sc->src_width + 1) * 4,
+                 cbgeneral = sc->factor ? 0 : sc->width * (4 * sizeof(float) + sizeof(AREA_SPAN)) + (sc->src_width + 1) * 4 * sizeof(uint32_t),
+                 cbacc = sc->width * 4 * (sc->factor ? sizeof(uint32_t) : sizeof(float));
+    if (!decoder_reserve(dec, &dec->scaler, 2 * cbacc + cbgeneral + cbrgba))
+        return false;
+    unsigned char* p = dec->scaler.data;
+    sc->acc[0] = p;
+    sc->acc[1] = p + cbacc;
+    sc->rgba = p + 2 * cbacc;
+    memset(p, 0, 2 * cbacc);
+    if (sc->factor) {
+        stats_stage(dec, BMP_STAGE_SETUP);
+        return true;
+    }
+
+    memset(sc->rgba + cbrgba - 4, 0, 4);
+    sc->spans = (AREA_SPAN*)(p + 2 * cbacc + cbrgba);
+    sc->hsum = (float*)(sc->spans + sc->width);
+    sc->prefix = (uint32_t*)(sc->hsum + sc->width * 4);
+    for (size_t ox = 0; ox < sc->width; ++ox) {
+        // output pixel ox covers units [start, start + src_width)
+        const uint64_t start = (uint64_t)ox * sc->src_width, x = start / sc->width,
+                       first = (x + 1) * sc->width - start,
+                       rest = sc->src_width - ((first < sc->src_width) ? first : sc->src_width);
+        AREA_SPAN* span = &sc->spans[ox];
+        span->x = (uint32_t)x;
+        span->first = (float)((first < sc->src_width) ? first : sc->src_width) / sc->src_width;
+        span->end = (uint32_t)(x + 1 + rest / sc->width);
+        span->last = (float)(rest % sc->width) / sc->src_width;
+    }
+    stats_stage(dec, BMP_STAGE_SETUP);
+    return true;
+}
+
+// Converts count rows of the window in file order, starting at its file row first, to their
+//  place in the output (or through the scaler). src points at the window's first byte
+//  (decoder_span) of each row.
+static void decoder_convert_rows(BMP_DECODER* dec, SCALER* sc, const unsigned char* src, size_t src_stride, size_t first, size_t count) {
+
+    if (sc) {
+        for (size_t i = 0; i < count; ++i, src += src_stride)
+            scaler_row(sc, src, first + i);
+        return;
+    }
+
+    const size_t rows = dec->image.height;
+    const bool flip = (dec->hdr.info.bmp3.Height > 0) == dec->options.top_down;
+    const unsigned shift = (dec->region.x * dec->hdr.info.bmp3.BitCount) & 7;
+    size_t span_first, span_last;
+    decoder_span(dec, &span_first, &span_last);
+    const size_t cbspan = span_last - span_first, cbout = (dec->region.width * dec->hdr.info.bmp3.BitCount + 7) / 8;
+
+    for (size_t i = 0; i < count; ++i, src += src_stride) {
+        const unsigned char* row = src;
+        if (shift) {
+            unsigned char* aligned = dec->columns.data;
+            for (size_t b = 0; b < cbout; ++b)
+                aligned[b] = (unsigned char)((row[b] << shift) | ((b + 1 < cbspan) ? row[b + 1] >> (8 - shift) : 0));
+            row = aligned;
+        }
+        const size_t y = flip ? rows - 1 - (first + i) : first + i;
+        dec->converter.row(&dec->converter, row, dec->pixels.data + y * dec->image.stride, dec->image.width);
+    }
+    stats_stage(dec, BMP_STAGE_CONVERT);
+}
+
+// Decodes the window's rows out of a whole RLE stream in memory. Decoding stops right after
+//  the window's top row; rows below it are walked through a single discarded row.
+static bool decoder_rle_window(BMP_DECODER* dec, SCALER* sc, const unsigned char* rle, size_t cbrle, unsigned char* rows, unsigned char* discard) {
+
+    const size_t row_bytes = bmp_row_bytes(&dec->hdr), first = decoder_first_file_row(dec);
+    if (!decode_rle_rows(rle, cbrle, &dec->hdr, (uint32_t)first, (uint32_t)(first + dec->region.height), rows, row_bytes, discard))
+        return decoder_fail(dec, BMP_ERR_CORRUPT, errno);
+    stats_stage(dec, BMP_STAGE_RLE);
+    size_t span_first, span_last;
+    decoder_span(dec, &span_first, &span_last);
+    decoder_convert_rows(dec, sc, rows + span_first, row_bytes, 0, dec->region.height);
+    return true;
+}
+
+// scratch layout for RLE: window rows, one discarded row, then cbrle bytes of stream
+static bool decoder_reserve_rle(BMP_DECODER* dec, size_t cbrle) {
+    const size_t row_bytes = bmp_row_bytes(&dec->hdr), rows = (size_t)dec->region.height + 1;
+    if (row_bytes && (rows > (SIZE_MAX - cbrle) / row_bytes))
+        return decoder_fail(dec, BMP_ERR_LIMIT, EFBIG);
+    return decoder_reserve(dec, &dec->scratch, row_bytes * rows + cbrle);
+}
+
+static bool decoder_finish(BMP_DECODER* dec, BMP_IMAGE* out) {
+    STATS_ADD(&dec->stats, decodes, 1);
+    dec->status = BMP_OK;
+    dec->error = 0;
+    memcpy(out, &dec->image, sizeof(BMP_IMAGE));
+    return true;
+}
+
+// Uncompressed rows are read a band at a time and converted while still in cache
+#define DECODER_BAND_BYTES (256 * 1024)
+
+// Headers and color table of the bitmap behind bmp_read
+static bool decoder_file_headers(BMP_DECODER* dec, FILE* bmp_read) {
+
+    unsigned char hdr[CB_SERIALIZED_BITMAPHEADERS_MAX];
+    stats_begin(dec);
+    STATS_ADD(&dec->stats, seeks, 1);
+    if (fseeko(bmp_read, 0, SEEK_SET))
+        return decoder_fail(dec, BMP_ERR_IO, errno);
+    const size_t cbhdr = fread(hdr, 1, sizeof(hdr), bmp_read);
+    STATS_ADD(&dec->stats, reads, 1);
+    STATS_ADD(&dec->stats, bytes_read, cbhdr);
+    if (!decoder_headers(dec, hdr, cbhdr) || !decoder_check_file_extent(dec, fileno(bmp_read)))
+        return false;
+
+    size_t offset;
+    const size_t count = bmp_palette_extent(&dec->hdr, &offset);
+    if (count) {
+        const size_t entry = bmp_palette_entry_bytes(&dec->hdr);
+        STATS_ADD(&dec->stats, seeks, 1);
+        STATS_ADD(&dec->stats, reads, 1);
+        STATS_ADD(&dec->stats, bytes_read, count * entry);
+        if (fseeko(bmp_read, (off_t)offset, SEEK_SET) || (count != fread(dec->palette, entry, count, bmp_read)))
+            return decoder_fail(dec, BMP_ERR_IO, EIO);
+        bmp_palette_widen(&dec->hdr, dec->palette, count);
+        dec->hdr.palette.array = dec->palette;
+        dec->hdr.palette.count = count;
+    }
+    stats_stage(dec, BMP_STAGE_HEADERS);
+    return true;
+}
+
+// Streams the whole pixel array of bmp_read through decoder_convert_rows
+static bool decoder_read_file(BMP_DECODER* dec, SCALER* sc, FILE* bmp_read) {
+
+    const size_t rows = dec->region.height,
+                 row_bytes = bmp_row_bytes(&dec->hdr),
+                 stride = bmp_row_stride(&dec->hdr);
+    STATS_ADD(&dec->stats, seeks, 1);
+    if (fseeko(bmp_read, (off_t)dec->hdr.file.bmp.BlobIndex, SEEK_SET))
+        return decoder_fail(dec, BMP_ERR_IO, errno);
+
+    if (decoder_rle(dec)) {
+        // compressed size is SizeImage when given, otherwise the rest of the stream, measured
+        //  by seeking so FILEs without a descriptor (fmemopen, funopen) work too
+        STATS_ADD(&dec->stats, seeks, 2);
+        if (fseeko(bmp_read, 0, SEEK_END))
+            return decoder_fail(dec, BMP_ERR_IO, errno);
+        const off_t end = ftello(bmp_read);
+        if (end < 0)
+            return decoder_fail(dec, BMP_ERR_IO, errno);
+        if (end < (off_t)dec->hdr.file.bmp.BlobIndex)
+            return decoder_fail(dec, BMP_ERR_IO, EIO);
+        if (fseeko(bmp_read, (off_t)dec->hdr.file.bmp.BlobIndex, SEEK_SET))
+            return decoder_fail(dec, BMP_ERR_IO, errno);
+        size_t cbrle = (size_t)end - dec->hdr.file.bmp.BlobIndex;
+        if (dec->hdr.info.bmp3.SizeImage && (dec->hdr.info.bmp3.SizeImage < cbrle))
+            cbrle = dec->hdr.info.bmp3.SizeImage;
+        if (!decoder_reserve_rle(dec, cbrle))
+            return false;
+        unsigned char* discard = dec->scratch.data + row_bytes * rows, *rle = discard + row_bytes;
+        cbrle = fread(rle, 1, cbrle, bmp_read);
+        stats_read(dec, cbrle);
+        return decoder_rle_window(dec, sc, rle, cbrle, dec->scratch.data, discard);
+    }
+
+    size_t band = DECODER_BAND_BYTES / stride;
+    band = band ? (band < rows ? band : rows) : 1;
+    if (!decoder_reserve(dec, &dec->scratch, band * stride))
+        return false;
+    for (size_t first = 0; first < rows; first += band) {
+        const size_t k = (rows - first < band) ? rows - first : band;
+        // the very last row's padding may be missing from the file
+        const size_t cb = k * stride - ((first + k == rows) ? stride - row_bytes : 0);
+        if (cb != fread(dec->scratch.data, 1, cb, bmp_read))
+            return decoder_fail(dec, BMP_ERR_IO, EIO);
+        stats_read(dec, cb);
+        decoder_convert_rows(dec, sc, dec->scratch.data, stride, first, k);
+    }
+    return true;
+}
+
+// Headers of a bitmap in memory; the color table is used in place unless it needs widening
+static bool decoder_memory_headers(BMP_DECODER* dec, const unsigned char* p, size_t cb) {
+
+    stats_begin(dec);
+    if (!decoder_headers(dec, p, cb) || !decoder_check_extent(dec, cb))
+        return false;
+    size_t offset;
+    const size_t count = bmp_palette_extent(&dec->hdr, &offset);
+    if (count) {
+        const size_t entry = bmp_palette_entry_bytes(&dec->hdr);
+        if (offset + count * entry > cb)
+            return decoder_fail(dec, BMP_ERR_IO, EBADF);
+        dec->hdr.palette.array = (RGBQUAD*)(p + offset);
+        if (sizeof(RGBQUAD) != entry) {
+            memcpy(dec->palette, p + offset, count * entry);
+            bmp_palette_widen(&dec->hdr, dec->palette, count);
+            dec->hdr.palette.array = dec->palette;
+        }
+        dec->hdr.palette.count = count;
+    }
+    stats_stage(dec, BMP_STAGE_HEADERS);
+    return true;
+}
+
+// The window's rows of a bitmap in memory through decoder_convert_rows, uncompressed ones in place
+static bool decoder_read_memory(BMP_DECODER* dec, SCALER* sc, const unsigned char* p, size_t cb) {
+
+    const size_t row_bytes = bmp_row_bytes(&dec->hdr),
+                 stride = bmp_row_stride(&dec->hdr);
+    if (dec->hdr.file.bmp.BlobIndex > cb)
+        return decoder_fail(dec, BMP_ERR_IO, EBADF);
+    const unsigned char* blob = p + dec->hdr.file.bmp.BlobIndex;
+    const size_t cbblob = cb - dec->hdr.file.bmp.BlobIndex;
+
+    if (decoder_rle(dec)) {
+        size_t cbrle = cbblob;
+        if (dec->hdr.info.bmp3.SizeImage && (dec->hdr.info.bmp3.SizeImage < cbrle))
+            cbrle = dec->hdr.info.bmp3.SizeImage;
+        return decoder_reserve_rle(dec, 0)
+            && decoder_rle_window(dec, sc, blob, cbrle, dec->scratch.data, dec->scratch.data + row_bytes * dec->region.height);
+    }
+
+    // decoder_memory_headers made sure every row is there
+    size_t span_first, span_last;
+    decoder_span(dec, &span_first, &span_last);
+    decoder_convert_rows(dec, sc, blob + decoder_first_file_row(dec) * stride + span_first, stride, 0, dec->region.height);
+    return true;
+}
+
+bool bmp_decoder_decode(BMP_DECODER* dec, FILE* bmp_read, BMP_IMAGE* out) {
+    return decoder_file_headers(dec, bmp_read)
+        && decoder_window(dec, NULL)
+        && decoder_output(dec, dec->region.width, dec->region.height)
+        && decoder_prepare(dec, dec->options.format)
+        && decoder_read_file(dec, NULL, bmp_read)
+        && decoder_finish(dec, out);
+}
+
+bool bmp_decoder_decode_path(BMP_DECODER* dec, const char* path, BMP_IMAGE* out) {
+
+    FILE* bmp_read = fopen(path, "rb");
+    if (!bmp_read)
+        return decoder_fail(dec, BMP_ERR_IO, errno);
+    const bool ok = bmp_decoder_decode(dec, bmp_read, out);
+    fclose(bmp_read);
+    return ok;
+}
+
+bool bmp_decoder_decode_region(BMP_DECODER* dec, int fd, const BMP_REGION* region, BMP_IMAGE* out) {
+
+    unsigned char hdr[CB_SERIALIZED_BITMAPHEADERS_MAX];
+    stats_begin(dec);
+    const ssize_t cbhdr = pread(fd, hdr, sizeof(hdr), 0);
+    if (cbhdr < 0)
+        return decoder_fail(dec, BMP_ERR_IO, errno);
+    STATS_ADD(&dec->stats, reads, 1);
+    STATS_ADD(&dec->stats, bytes_read, cbhdr);
+    if (!decoder_headers(dec, hdr, (size_t)cbhdr) || !decoder_check_file_extent(dec, fd) || !decoder_window(dec, region)
+        || !decoder_output(dec, dec->region.width, dec->region.height))
+        return false;
+
+    size_t offset;
+    const size_t count = bmp_palette_extent(&dec->hdr, &offset);
+    if (count) {
+        const size_t entry = bmp_palette_entry_bytes(&dec->hdr);
+        if (!pread_all(fd, dec->palette, count * entry, (off_t)offset))
+            return decoder_fail(dec, BMP_ERR_IO, errno);
+        STATS_ADD(&dec->stats, reads, 1);
+        STATS_ADD(&dec->stats, bytes_read, count * entry);
+        bmp_palette_widen(&dec->hdr, dec->palette, count);
+        dec->hdr.palette.array = dec->palette;
+        dec->hdr.palette.count = count;
+    }
+    stats_stage(dec, BMP_STAGE_HEADERS);
+    if (!decoder_prepare(dec, dec->options.format))
+        return false;
+
+    const size_t rows = dec->region.height,
+                 row_bytes = bmp_row_bytes(&dec->hdr),
+                 stride = bmp_row_stride(&dec->hdr),
+                 first = decoder_first_file_row(dec),
+                 last_row = (size_t)abs(dec->hdr.info.bmp3.Height) - 1;
+    const off_t blob = (off_t)dec->hdr.file.bmp.BlobIndex;
+
+    if (decoder_rle(dec)) {
+        struct stat st;
+        if (fstat(fd, &st) || (st.st_size < blob))
+            return decoder_fail(dec, BMP_ERR_IO, EIO);
+        size_t cbrle = (size_t)(st.st_size - blob);
+        if (dec->hdr.info.bmp3.SizeImage && (dec->hdr.info.bmp3.SizeImage < cbrle))
+            cbrle = dec->hdr.info.bmp3.SizeImage;
+        if (!decoder_reserve_rle(dec, cbrle))
+            return false;
+        unsigned char* discard = dec->scratch.data + row_bytes * rows, *rle = discard + row_bytes;
+        if (!pread_all(fd, rle, cbrle, blob))
+            return decoder_fail(dec, BMP_ERR_IO, errno);
+        stats_read(dec, cbrle);
+        return decoder_rle_window(dec, NULL, rle, cbrle, dec->scratch.data, discard) && decoder_finish(dec, out);
+    }
+
+    size_t span_first, span_last;
+    decoder_span(dec, &span_first, &span_last);
+    const size_t cbspan = span_last - span_first;
+
+    if (2 * cbspan < stride) {
+        // narrow window: only its columns are read, a row at a time
+        size_t band = DECODER_BAND_BYTES / cbspan;
+        band = band ? (band < rows ? band : rows) : 1;
+        if (!decoder_reserve(dec, &dec->scratch, band * cbspan))
+            return false;
+        for (size_t r = 0; r < rows; r += band) {
+            const size_t k = (rows - r < band) ? rows - r : band;
+            for (size_t i = 0; i < k; ++i) {
+                if (!pread_all(fd, dec->scratch.data + i * cbspan, cbspan, blob + (off_t)((first + r + i) * stride + span_first)))
+                    return decoder_fail(dec, BMP_ERR_IO, errno);
+                stats_read(dec, cbspan);
+            }
+            decoder_convert_rows(dec, NULL, dec->scratch.data, cbspan, r, k);
+        }
+        return decoder_finish(dec, out);
+    }
+
+    // wide window: whole rows in bands, with one pread each
+    size_t band = DECODER_BAND_BYTES / stride;
+    band = band ? (band < rows ? band : rows) : 1;
+    if (!decoder_reserve(dec, &dec->scratch, band * stride))
+        return false;
+    for (size_t r = 0; r < rows; r += band) {
+        const size_t k = (rows - r < band) ? rows - r : band;
+        // the file's very last row may come without its padding
+        const size_t cb = k * stride - ((first + r + k - 1 == last_row) ? stride - row_bytes : 0);
+        if (!pread_all(fd, dec->scratch.data, cb, blob + (off_t)((first + r) * stride)))
+            return decoder_fail(dec, BMP_ERR_IO, errno);
+        stats_read(dec, cb);
+        decoder_convert_rows(dec, NULL, dec->scratch.data + span_first, stride, r, k);
+    }
+    return decoder_finish(dec, out);
+}
+
+bool bmp_decoder_decode_region_memory(BMP_DECODER* dec, const void* data, size_t cb, const BMP_REGION* region, BMP_IMAGE* out) {
+    return decoder_memory_headers(dec, data, cb)
+        && decoder_window(dec, region)
+        && decoder_output(dec, dec->region.width, dec->region.height)
+        && decoder_prepare(dec, dec->options.format)
+        && decoder_read_memory(dec, NULL, data, cb)
+        && decoder_finish(dec, out);
+}
+
+bool bmp_decoder_decode_memory(BMP_DECODER* dec, const void* data, size_t cb, BMP_IMAGE* out) {
+    return bmp_decoder_decode_region_memory(dec, data, cb, NULL, out);
+}
+
+// Output size for a scaled decode: a 0 dimension follows the other's ratio, rounded
+static bool decoder_scaled_output(BMP_DECODER* dec, uint32_t width, uint32_t height) {
+
+    const uint64_t w = dec->region.width, h = dec->region.height;
+    if (!width && !height)
+        return decoder_fail(dec, BMP_ERR_ARGUMENT, EINVAL);
+    if (!width)
+        width = (uint32_t)((w * height + h / 2) / h), width += !width;
+    if (!height)
+        height = (uint32_t)((h * width + w / 2) / w), height += !height;
+    // downscaling only; source widths are capped so 255 * width fits the row sums
+    if ((width > w) || (height > h))
+        return decoder_fail(dec, BMP_ERR_ARGUMENT, EINVAL);
+    if (w >= (1U << 24))
+        return decoder_fail(dec, BMP_ERR_LIMIT, EFBIG);
+    return decoder_output(dec, width, height);
+}
+
+bool bmp_decoder_decode_scaled(BMP_DECODER* dec, FILE* bmp_read, uint32_t width, uint32_t height, BMP_IMAGE* out) {
+
+    SCALER sc;
+    return decoder_file_headers(dec, bmp_read)
+        && decoder_window(dec, NULL)
+        && decoder_scaled_output(dec, width, height)
+        && decoder_prepare(dec, BMP_FORMAT_RGBA8_PREMULTIPLIED)
+        && scaler_init(&sc, dec)
+        && decoder_read_file(dec, &sc, bmp_read)
+        && decoder_finish(dec, out);
+}
+
+bool bmp_decoder_decode_scaled_memory(BMP_DECODER* dec, const void* data, size_t cb, uint32_t width, uint32_t height, BMP_IMAGE* out) {
+
+    SCALER sc;
+    return decoder_memory_headers(dec, data, cb)
+        && decoder_window(dec, NULL)
+        && decoder_scaled_output(dec, width, height)
+        && decoder_prepare(dec, BMP_FORMAT_RGBA8_PREMULTIPLIED)
+        && scaler_init(&sc, dec)
+        && decoder_read_memory(dec, &sc, data, cb)
+        && decoder_finish(dec, out);
+}
+
+// ===                              ===
+// ===        Batch pipeline        ===
+// ===                              ===
+
+#ifdef BMP_IO_URING
+// File header + BITMAPINFOHEADER: enough for BlobIndex and the size of the pixel array
+#define BATCH_HEAD (CB_SERIALIZED_BITMAPFILEHEADER + CB_SERIALIZED_BITMAPV3INFOHEADER)
+#define BATCH_DEPTH 32
+
+// One source on its way through the pipeline: header read, then the rest of the image
+typedef struct {
+    size_t index;
+    int fd;
+    size_t file_size;
+    unsigned char head[BATCH_HEAD];
+    unsigned char* data;        // NULL while the header is read, then the file up to the end
+                                //  of the pixel array (or the caller's buffer)
+    size_t size, done;          // bytes wanted / read so far, the header included
+    unsigned char* buffer;      // reused from file to file, so pages stay mapped and warm
+    size_t capacity;
+    bool reading;               // a ring read is in flight
+    BMP_STATUS status;          // of the read
+    struct iovec iov;
+} BATCH_SLOT;
+#endif
+
+typedef struct {
+    const BMP_BATCH_SOURCE* sources;
+    size_t count;
+    const BMP_ALLOCATOR* allocator;
+    BMP_BATCH_CALLBACK callback;
+    void* user;
+
+    pthread_mutex_t lock;
+    BMP_DECODER* decoders;      // one per worker
+    BMP_DECODER** idle;         // stack of idle decoders, guarded by lock
+    size_t idle_count;
+    BMP_STATS io;               // reads made outside the decoders by the I/O thread, and
+                                //  sources that never reached a decoder (under lock)
+
+#ifdef BMP_IO_URING
+    // io_uring pipeline: slots go free -> reading -> ready -> decoded -> free, queues
+    //  guarded by lock
+    BATCH_SLOT* slots;
+    size_t depth;
+    size_t* free_slots;
+    size_t free_count;
+    size_t* ready;              // ring of read slots waiting for a decoder
+    size_t ready_head, ready_count;
+    pthread_cond_t ready_cond, free_cond;
+#endif
+} BATCH;
+
+// Decodes sources[index], from data when given and from fd otherwise, and hands the result
+//  to the callback
+static bool batch_decode(BATCH* batch, size_t index, int fd, const void* data, size_t size) {
+
+    pthread_mutex_lock(&batch->lock);
+    BMP_DECODER* dec = batch->idle[--batch->idle_count];
+    pthread_mutex_unlock(&batch->lock);
+
+    BMP_IMAGE image;
+    const bool ok = data ? bmp_decoder_decode_memory(dec, data, size, &image)
+                         : bmp_decoder_decode_region(dec, fd, NULL, &image);
+    // image lives in the decoder's buffers, so the decoder stays taken until the callback returns
+    batch->callback(batch->user, index, ok ? BMP_OK : dec->status, ok ? &image : NULL);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->idle[batch->idle_count++] = dec;
+    pthread_mutex_unlock(&batch->lock);
+    return ok;
+}
+
+// Reports a source that could not be read
+static bool batch_failed(BATCH* batch, size_t index, BMP_STATUS status) {
+    pthread_mutex_lock(&batch->lock);
+    STATS_ADD(&batch->io, failures, 1);
+    pthread_mutex_unlock(&batch->lock);
+    batch->callback(batch->user, index, status, NULL);
+    return false;
+}
+
+// Fallback: every worker opens its file and decodes it with pread, reusing the decoder's
+//  buffers from file to file
+static bool batch_pread_job(void* ctx, size_t i, void** scratch) {
+
+    BATCH* batch = ctx;
+    const BMP_BATCH_SOURCE* src = &batch->sources[i];
+    if (!src->path)
+        return batch_decode(batch, i, -1, src->data, src->size);
+    const int fd = open(src->path, O_RDONLY);
+    if (fd < 0)
+        return batch_failed(batch, i, BMP_ERR_IO);
+    const bool ok = batch_decode(batch, i, fd, NULL, 0);
+    close(fd);
+    return ok;
+}
+
+#ifdef BMP_IO_URING
+
+static bool batch_fail(BATCH_SLOT* slot, BMP_STATUS status) {
+    slot->status = status;
+    return false;
+}
+
+// Bytes of the file needed to decode it, from its first cbhead bytes: up to the end of the
+//  pixel array when the header gives it, otherwise the whole file. Never past file_size.
+static size_t batch_extent(const unsigned char* head, size_t cbhead, size_t file_size) {
+
+    if ((cbhead < BATCH_HEAD) || (BMP_TYPE_MAGIC != load_little_u16(head))
+        || (load_little_u32(head + 14) < CB_SERIALIZED_BITMAPV3INFOHEADER))
+        return file_size;
+
+    const uint64_t blob = load_little_u32(head + 10),
+                   width = (uint64_t)llabs((int32_t)load_little_u32(head + 18)),
+                   height = (uint64_t)llabs((int32_t)load_little_u32(head + 22)),
+                   bits = load_little_u16(head + 28);
+    const uint32_t compression = load_little_u32(head + 30), size_image = load_little_u32(head + 34);
+    uint64_t end = file_size;
+    if ((BMP_COMPRESSION_NONE == compression) || (BMP_COMPRESSION_BITFIELDS == compression))
+        end = blob + ((width * bits + 31) / 32 * 4) * height;
+    else if (size_image)
+        end = blob + size_image;
+    return (end < file_size) ? (size_t)end : file_size;
+}
+
+// Sets slot up for sources[index]. Memory sources need no reads; false when nothing is
+//  left to read (or opening failed).
+static bool batch_start(BATCH* batch, BATCH_SLOT* slot, size_t index) {
+
+    const BMP_BATCH_SOURCE* src = &batch->sources[index];
+    unsigned char* buffer = slot->buffer;
+    const size_t capacity = slot->capacity;
+    memset(slot, 0, sizeof(BATCH_SLOT));
+    slot->buffer = buffer;
+    slot->capacity = capacity;
+    slot->index = index;
+    slot->fd = -1;
+    slot->status = BMP_OK;
+    if (!src->path) {
+        slot->data = (unsigned char*)src->data;
+        slot->size = slot->done = src->size;
+        return false;
+    }
+
+    struct stat st;
+    if ((slot->fd = open(src->path, O_RDONLY)) < 0)
+        return batch_fail(slot, BMP_ERR_IO);
+    if (fstat(slot->fd, &st) || (st.st_size <= 0))
+        return batch_fail(slot, BMP_ERR_IO);
+    slot->file_size = (size_t)st.st_size;
+    return true;
+}
+
+// Where the next read of slot goes
+static void batch_pending(BATCH_SLOT* slot) {
+    if (!slot->data) {
+        const size_t want = (slot->file_size < BATCH_HEAD) ? slot->file_size : BATCH_HEAD;
+        slot->iov.iov_base = slot->head + slot->done;
+        slot->iov.iov_len = want - slot->done;
+    }
+    else {
+        slot->iov.iov_base = slot->data + slot->done;
+        slot->iov.iov_len = slot->size - slot->done;
+    }
+}
+
+// Accounts for a read of cb bytes (0 at end of file). Once the header is in, the buffer
+//  for the whole image is sized from it. False when the slot is read in full or failed.
+static bool batch_progress(BATCH* batch, BATCH_SLOT* slot, size_t cb) {
+
+    slot->done += cb;
+    if (!slot->data) {
+        if (cb && (slot->done < BATCH_HEAD) && (slot->done < slot->file_size))
+            return true;
+        const size_t size = batch_extent(slot->head, slot->done, slot->file_size);
+        if (size > slot->capacity) {
+            bmp_free(batch->allocator, slot->buffer);
+            slot->capacity = 0;
+            if (!(slot->buffer = bmp_alloc(batch->allocator, size)))
+                return batch_fail(slot, BMP_ERR_NOMEM);
+            slot->capacity = size;
+        }
+        slot->data = slot->buffer;
+        slot->size = size;
+        slot->done = (slot->done < size) ? slot->done : size;
+        memcpy(slot->data, slot->head, slot->done);
+    }
+    // a file shorter than its header says is left for the decoder to report
+    if (!cb)
+        slot->size = slot->done;
+    return slot->done < slot->size;
+}
+
+// Blocking reads of whatever slot still needs
+static void batch_read_sync(BATCH* batch, BATCH_SLOT* slot) {
+    for (;;) {
+        batch_pending(slot);
+        const ssize_t cb = pread(slot->fd, slot->iov.iov_base, slot->iov.iov_len, (off_t)slot->done);
+        if (cb < 0) {
+            if (EINTR == errno)
+                continue;
+            batch_fail(slot, BMP_ERR_IO);
+            return;
+        }
+        STATS_ADD(&batch->io, reads, 1);
+        STATS_ADD(&batch->io, bytes_read, cb);
+        if (!batch_progress(batch, slot, (size_t)cb))
+            return;
+    }
+}
+
+static void batch_close(BATCH_SLOT* slot) {
+    if (slot->fd >= 0)
+        close(slot->fd);
+    slot->fd = -1;
+}
+
+// Minimal io_uring ring: one shared mapping for both queues (kernel 5.4+), READV only
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail, *sq_array, sq_mask;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* rings;
+    size_t cbrings, cbsqes;
+    unsigned queued;            // prepared, not submitted yet
+} URING;
+
+static bool uring_init(URING* ring, unsigned entries) {
+
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(URING));
+    memset(&params, 0, sizeof(params));
+    const long fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return false;
+    ring->fd = (int)fd;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        return errno = ENOSYS, false;
+    }
+
+    const size_t cbsq = params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                 cbcq = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->cbrings = (cbsq > cbcq) ? cbsq : cbcq;
+    ring->cbsqes = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->rings = mmap(NULL, ring->cbrings, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->rings) {
+        close(ring->fd);
+        return false;
+    }
+    ring->sqes = mmap(NULL, ring->cbsqes, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sqes) {
+        munmap(ring->rings, ring->cbrings);
+        close(ring->fd);
+        return false;
+    }
+
+    unsigned char* p = ring->rings;
+    ring->entries = params.sq_entries;
+    ring->sq_tail = (unsigned*)(p + params.sq_off.tail);
+    ring->sq_array = (unsigned*)(p + params.sq_off.array);
+    ring->sq_mask = *(unsigned*)(p + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned*)(p + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(p + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(p + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(p + params.cq_off.cqes);
+    return true;
+}
+
+static void uring_destroy(URING* ring) {
+    munmap(ring->sqes, ring->cbsqes);
+    munmap(ring->rings, ring->cbrings);
+    close(ring->fd);
+}
+
+// Queues a read into iov at offset; goes to the kernel with the next uring_enter
+static void uring_readv(URING* ring, int fd, const struct iovec* iov, off_t offset, uint64_t user_data) {
+    const unsigned tail = *ring->sq_tail, i = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[i];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = user_data;
+    ring->sq_array[i] = i;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->queued;
+}
+
+// Submits what is queued and waits for at least one completion
+static bool uring_enter(URING* ring) {
+    for (;;) {
+        const long n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0) {
+            ring->queued -= (unsigned)n;
+            if (!ring->queued)
+                return true;
+        }
+        else if ((EINTR != errno) && (EAGAIN != errno) && (EBUSY != errno))
+            return false;
+    }
+}
+
+typedef struct {
+    BATCH* batch;
+    URING ring;
+} BATCH_RING;
+
+// Hands a read slot to the decoders
+static void batch_ready(BATCH* batch, size_t i) {
+    batch_close(&batch->slots[i]);
+    pthread_mutex_lock(&batch->lock);
+    batch->ready[(batch->ready_head + batch->ready_count++) % batch->depth] = i;
+    pthread_cond_signal(&batch->ready_cond);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void batch_submit(BATCH_RING* br, size_t i) {
+    BATCH_SLOT* slot = &br->batch->slots[i];
+    batch_pending(slot);
+    slot->reading = true;
+    uring_readv(&br->ring, slot->fd, &slot->iov, (off_t)slot->done, i);
+}
+
+// The I/O thread: keeps up to depth sources moving through the ring, header read first and
+//  then exactly the rest of the image. Opens are synchronous; they rarely touch the disk.
+static void* batch_ring_thread(void* arg) {
+
+    BATCH_RING* br = arg;
+    BATCH* batch = br->batch;
+    size_t next = 0, reading = 0;
+    bool ring_ok = true;
+
+    while ((next < batch->count) || reading) {
+        pthread_mutex_lock(&batch->lock);
+        // with nothing in flight the only thing to wait for is decoders freeing slots; refill
+        //  in bulk unless they run dry, rather than waking up for every file
+        while (!reading && (next < batch->count)
+            && (!batch->free_count || ((batch->free_count < batch->depth / 2) && batch->ready_count)))
+            pthread_cond_wait(&batch->free_cond, &batch->lock);
+        while ((next < batch->count) && batch->free_count) {
+            const size_t i = batch->free_slots[--batch->free_count];
+            pthread_mutex_unlock(&batch->lock);
+            BATCH_SLOT* slot = &batch->slots[i];
+            if (batch_start(batch, slot, next++)) {
+                if (ring_ok) {
+                    batch_submit(br, i);
+                    ++reading;
+                }
+                else {
+                    batch_read_sync(batch, slot);
+                    batch_ready(batch, i);
+                }
+            }
+            else batch_ready(batch, i);
+            pthread_mutex_lock(&batch->lock);
+        }
+        pthread_mutex_unlock(&batch->lock);
+        if (!reading)
+            continue;
+
+        if (!uring_enter(&br->ring)) {
+            // the ring is unusable: finish what it held with pread, and carry on without it
+            ring_ok = false;
+            for (size_t i = 0; i < batch->depth; ++i)
+                if (batch->slots[i].reading) {
+                    batch->slots[i].reading = false;
+                    batch_read_sync(batch, &batch->slots[i]);
+                    batch_ready(batch, i);
+                }
+            reading = 0;
+            continue;
+        }
+
+        unsigned head = *br->ring.cq_head;
+        const unsigned tail = __atomic_load_n(br->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe* cqe = &br->ring.cqes[head & br->ring.cq_mask];
+            const size_t i = (size_t)cqe->user_data;
+            BATCH_SLOT* slot = &batch->slots[i];
+            slot->reading = false;
+            --reading;
+            STATS_ADD(&batch->io, reads, 1);
+            STATS_ADD(&batch->io, bytes_read, (cqe->res > 0) ? cqe->res : 0);
+            if ((-EINTR == cqe->res) || (-EAGAIN == cqe->res)) {
+                batch_submit(br, i);
+                ++reading;
+            }
+            else if ((cqe->res >= 0) && batch_progress(batch, slot, (size_t)cqe->res)) {
+                batch_submit(br, i);
+                ++reading;
+            }
+            else {
+                if (cqe->res < 0)
+                    batch_fail(slot, BMP_ERR_IO);
+                batch_ready(batch, i);
+            }
+        }
+        __atomic_store_n(br->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Decode side of the ring pipeline: each job takes whichever source was read next
+static bool batch_ring_job(void* ctx, size_t job, void** scratch) {
+
+    BATCH* batch = ctx;
+    pthread_mutex_lock(&batch->lock);
+    while (!batch->ready_count)
+        pthread_cond_wait(&batch->ready_cond, &batch->lock);
+    const size_t i = batch->ready[batch->ready_head];
+    batch->ready_head = (batch->ready_head + 1) % batch->depth;
+    --batch->ready_count;
+    pthread_mutex_unlock(&batch->lock);
+
+    const BATCH_SLOT* slot = &batch->slots[i];
+    bool ok = false;
+    if (BMP_OK == slot->status)
+        ok = batch_decode(batch, slot->index, -1, slot->data, slot->size);
+    else batch_failed(batch, slot->index, slot->status);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->free_slots[batch->free_count++] = i;
+    if ((batch->free_count >= batch->depth / 2) || !batch->ready_count)
+        pthread_cond_signal(&batch->free_cond);
+    pthread_mutex_unlock(&batch->lock);
+    return ok;
+}
+
+// Runs the batch through io_uring; false (nothing decoded yet) when the ring or its
+//  thread cannot be set up
+static bool batch_ring_run(BATCH* batch, unsigned workers, size_t depth, size_t* decoded) {
+
+    BATCH_RING br = { .batch = batch };
+    batch->depth = depth;
+    batch->slots = calloc(depth, sizeof(BATCH_SLOT));
+    batch->free_slots = calloc(depth, sizeof(size_t));
+    batch->ready = calloc(depth, sizeof(size_t));
+    bool ok = batch->slots && batch->free_slots && batch->ready;
+    if (ok && pthread_cond_init(&batch->ready_cond, NULL))
+        ok = false;
+    else if (ok && pthread_cond_init(&batch->free_cond, NULL)) {
+        pthread_cond_destroy(&batch->ready_cond);
+        ok = false;
+    }
+
+    if (ok) {
+        for (size_t i = 0; i < depth; ++i)
+            batch->free_slots[i] = depth - 1 - i;
+        batch->free_count = depth;
+
+        pthread_t io;
+        if ((ok = uring_init(&br.ring, (unsigned)depth))) {
+            if ((ok = !pthread_create(&io, NULL, batch_ring_thread, &br))) {
+                *decoded = batch->count - parallel_for(workers, batch->count, 1, batch_ring_job, batch);
+                pthread_join(io, NULL);
+            }
+            uring_destroy(&br.ring);
+        }
+        pthread_cond_destroy(&batch->ready_cond);
+        pthread_cond_destroy(&batch->free_cond);
+    }
+    if (batch->slots)
+        for (size_t i = 0; i < depth; ++i)
+            bmp_free(batch->allocator, batch->slots[i].buffer);
+    free(batch->slots);
+    free(batch->free_slots);
+    free(batch->ready);
+    return ok;
+}
+
+#endif // BMP_IO_URING
+
+size_t bmp_decode_batch(const BMP_BATCH_SOURCE* sources, size_t count, const BMP_BATCH_OPTIONS* options,
+    const BMP_ALLOCATOR* allocator, BMP_BATCH_CALLBACK callback, void* user) {
+
+    BMP_BATCH_OPTIONS opts = { .options = { .format = BMP_FORMAT_RGBA8, .top_down = true } };
+    if (options)
+        opts = *options;
+    if (!callback || (count && !sources))
+        return errno = EINVAL, 0;
+    if (!count)
+        return 0;
+
+    unsigned workers = opts.workers;
+    if (!workers) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (online > 0) ? (unsigned)online : 1;
+    }
+    if (workers > count)
+        workers = (unsigned)count;
+
+    BATCH batch = { .sources = sources, .count = count, .allocator = allocator, .callback = callback, .user = user };
+    batch.decoders = calloc(workers, sizeof(BMP_DECODER));
+    batch.idle = calloc(workers, sizeof(BMP_DECODER*));
+    if (!batch.decoders || !batch.idle || pthread_mutex_init(&batch.lock, NULL)) {
+        free(batch.decoders);
+        free(batch.idle);
+        return errno = ENOMEM, 0;
+    }
+
+    size_t decoded = 0;
+    bool ok = true;
+    for (unsigned i = 0; i < workers; ++i) {
+        ok &= bmp_decoder_init(&batch.decoders[i], &opts.options, allocator);
+        batch.idle[batch.idle_count++] = &batch.decoders[i];
+    }
+    if (ok) {
+#ifdef BMP_IO_URING
+        const size_t depth = opts.depth ? opts.depth : BATCH_DEPTH;
+        if (opts.pread_only || !batch_ring_run(&batch, workers, (depth < count) ? depth : count, &decoded))
+#endif
+            decoded = count - parallel_for(workers, count, 1, batch_pread_job, &batch);
+    }
+    else errno = EINVAL;
+
+    if (opts.stats) {
+        bmp_stats_merge(opts.stats, &batch.io);
+        for (unsigned i = 0; i < workers; ++i)
+            bmp_stats_merge(opts.stats, &batch.decoders[i].stats);
+    }
+    for (unsigned i = 0; i < workers; ++i)
+        bmp_decoder_destroy(&batch.decoders[i]);
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.decoders);
+    free(batch.idle);
+    return decoded;
+}
+
+// ===                              ===
+// ===           Writing            ===
+// ===                              ===
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// writev until everything is out, picking up after short writes
+static bool writev_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t done = writev(fd, iov, count);
+        if (done < 0) {
+            if (EINTR == errno)
+                continue;
+            return false;
+        }
+        while ((count > 0) && ((size_t)done >= iov->iov_len))
+            done -= (ssize_t)iov->iov_len, ++iov, --count;
+        if (count > 0) {
+            iov->iov_base = (unsigned char*)iov->iov_base + done;
+            iov->iov_len -= (size_t)done;
+        }
+    }
+    return true;
+}
+
+// write_bmp with the pixel array from in->blob, or when rle is given its cbrle bytes
+static bool write_bmp_as(int fd, const UNSERIAL_BITMAP* in, uint32_t hdrsize, uint32_t compression, const unsigned char* rle, size_t cbrle) {
+
+    if (((CB_SERIALIZED_BITMAPV3INFOHEADER != hdrsize) && (CB_SERIALIZED_BITMAPV5INFOHEADER != hdrsize))
+        || ((BMP_COMPRESSION_NONE != compression) && (BMP_COMPRESSION_BITFIELDS != compression) && !rle)
+        || !in->blob)
+        return errno = EINVAL, false;
+
+    // rows go out DWORD aligned whatever blob's stride (a DDB's is its WidthCb), and a DDB
+    //  gets the stand-in color table bmp_palette_init reads its indices through
+    const bool ddb = bmp_is_ddb(in);
+    const size_t row_bytes = bmp_row_bytes(in), stride = (row_bytes + 3) & ~(size_t)3,
+                 rows = (size_t)abs(in->info.bmp3.Height),
+                 colors = ddb ? (size_t)1 << in->info.bmp3.BitCount
+                              : (in->palette.array && (in->info.bmp3.BitCount <= 8)) ? in->palette.count : 0;
+    // v3 carries bitfield masks after the header, v5 inside it
+    const size_t cbmasks = ((BMP_COMPRESSION_BITFIELDS == compression) && (CB_SERIALIZED_BITMAPV3INFOHEADER == hdrsize)) ? 12 : 0,
+                 cbheaders = CB_SERIALIZED_BITMAPFILEHEADER + hdrsize + cbmasks + colors * sizeof(RGBQUAD),
+                 cbpixels = rle ? cbrle : stride * rows;
+    if ((colors > 256) || (!rle && (cbpixels / (stride ? stride : 1) != rows)) || (cbheaders + cbpixels > UINT32_MAX))
+        return errno = EFBIG, false;
+
+    unsigned char* hdr = calloc(1, cbheaders);
+    if (!hdr)
+        return errno = ENOMEM, false;
+
+    store_little_u16(hdr, BMP_TYPE_MAGIC);
+    store_little_u32(hdr + 2, (uint32_t)(cbheaders + cbpixels));
+    store_little_u32(hdr + 10, (uint32_t)cbheaders);
+
+    unsigned char* info = hdr + CB_SERIALIZED_BITMAPFILEHEADER;
+    store_little_u32(info, hdrsize);
+    store_little_u32(info + 4, (uint32_t)in->info.bmp3.Width);
+    store_little_u32(info + 8, (uint32_t)in->info.bmp3.Height);
+    store_little_u16(info + 12, 1);
+    store_little_u16(info + 14, in->info.bmp3.BitCount);
+    store_little_u32(info + 16, compression);
+    store_little_u32(info + 20, (uint32_t)cbpixels);
+    store_little_u32(info + 24, (uint32_t)in->info.bmp3.XPxPerMeter);
+    store_little_u32(info + 28, (uint32_t)in->info.bmp3.YPxPerMeter);
+    store_little_u32(info + 32, (uint32_t)colors);
+    store_little_u32(info + 36, in->info.bmp3.ClrImportant);
+    if (BMP_COMPRESSION_BITFIELDS == compression) {
+        store_little_u32(info + 40, in->info.bmp3_nt.RedMask);
+        store_little_u32(info + 44, in->info.bmp3_nt.GreenMask);
+        store_little_u32(info + 48, in->info.bmp3_nt.BlueMask);
+    }
+    if (CB_SERIALIZED_BITMAPV5INFOHEADER == hdrsize) {
+        if ((BMP_COMPRESSION_BITFIELDS == compression) && (in->info.hdrsize >= CB_SERIALIZED_BITMAPV4INFOHEADER))
+            store_little_u32(info + 52, in->info.bmp4.AlphaMask);
+        // the color space carries over from a v4 / v5 source, short of its profile
+        const bool v4 = in->info.hdrsize >= CB_SERIALIZED_BITMAPV4INFOHEADER,
+                   profile = v4 && ((PROFILE_EMBEDDED == in->info.bmp4.CSType) || (PROFILE_LINKED == in->info.bmp4.CSType));
+        if (v4 && !profile) {
+            const BMP_CIEXYZ* xyz[] = { &in->info.bmp4.Endpoints.Red, &in->info.bmp4.Endpoints.Green, &in->info.bmp4.Endpoints.Blue };
+            store_little_u32(info + 56, in->info.bmp4.CSType);
+            for (unsigned i = 0; i < 3; ++i) {
+                store_little_u32(info + 60 + i * 12, (uint32_t)xyz[i]->X);
+                store_little_u32(info + 64 + i * 12, (uint32_t)xyz[i]->Y);
+                store_little_u32(info + 68 + i * 12, (uint32_t)xyz[i]->Z);
+            }
+            store_little_u32(info + 96, in->info.bmp4.GammaRed);
+            store_little_u32(info + 100, in->info.bmp4.GammaGreen);
+            store_little_u32(info + 104, in->info.bmp4.GammaBlue);
+        }
+        else store_little_u32(info + 56, LCS_sRGB);
+        const bool v5 = in->info.hdrsize >= CB_SERIALIZED_BITMAPV5INFOHEADER;
+        store_little_u32(info + 108, (v5 && in->info.bmp5.Intent) ? in->info.bmp5.Intent : LCS_GM_IMAGES);
+    }
+    if (ddb)
+        for (size_t i = 0; i < colors; ++i) {
+            unsigned char rgb[3], * q = info + hdrsize + cbmasks + i * sizeof(RGBQUAD);
+            ddb_color(in->info.bmp3.BitCount, i, rgb);
+            q[0] = rgb[2], q[1] = rgb[1], q[2] = rgb[0];
+        }
+    else if (colors)
+        memcpy(info + hdrsize + cbmasks, in->palette.array, colors * sizeof(RGBQUAD));
+
+    static const unsigned char zero_pad[4];
+    struct iovec iov[IOV_MAX];
+    int n = 0;
+    iov[n].iov_base = hdr, iov[n++].iov_len = cbheaders;
+
+    bool ok = true;
+    if (rle) {
+        iov[n].iov_base = (void*)rle, iov[n++].iov_len = cbrle;
+        ok = writev_all(fd, iov, n);
+    }
+    else if ((in->stride == stride) || (rows <= 1)) {
+        // already laid out as on disk: one write for the whole pixel array (the last row's
+        //  padding may not be in blob, that comes from the zero pad)
+        iov[n].iov_base = in->blob, iov[n++].iov_len = rows ? (rows - 1) * stride + row_bytes : 0;
+        if (rows && (stride > row_bytes))
+            iov[n].iov_base = (void*)zero_pad, iov[n++].iov_len = stride - row_bytes;
+        ok = writev_all(fd, iov, n);
+    }
+    else {
+        const size_t pad = stride - row_bytes;
+        for (size_t y = 0; ok && (y < rows); ++y) {
+            iov[n].iov_base = in->blob + y * in->stride, iov[n++].iov_len = row_bytes;
+            if (pad)
+                iov[n].iov_base = (void*)zero_pad, iov[n++].iov_len = pad;
+            if ((n + 2 > IOV_MAX) || (y + 1 == rows)) {
+                ok = writev_all(fd, iov, n);
+                n = 0;
+            }
+        }
+    }
+
+    free(hdr);
+    return ok;
+}
+
+bool write_bmp(int fd, const UNSERIAL_BITMAP* in, uint32_t hdrsize) {
+
+    const uint32_t compression = in->info.bmp3.Compression;
+    if ((BMP_COMPRESSION_RLE8 != compression) && (BMP_COMPRESSION_RLE4 != compression))
+        return write_bmp_as(fd, in, hdrsize, compression, NULL, 0);
+
+    // blob holds the indices (as parse_bmp leaves RLE images), encoded again here
+    const size_t cb = bmp_rle_bound(in);
+    unsigned char* rle = cb ? malloc(cb) : NULL;
+    if (!rle)
+        return errno = cb ? ENOMEM : EINVAL, false;
+    size_t cbrle;
+    const bool ok = bmp_encode_rle(in, compression, rle, cb, &cbrle)
+        && write_bmp_as(fd, in, hdrsize, compression, rle, cbrle);
+    free(rle);
+    return ok;
+}
+
+bool write_bmp_compressed(int fd, const UNSERIAL_BITMAP* in, uint32_t hdrsize) {
+
+    const unsigned bits = in->info.bmp3.BitCount;
+    if ((BMP_COMPRESSION_NONE != in->info.bmp3.Compression) || ((8 != bits) && (4 != bits))
+        || (in->info.bmp3.Width <= 0) || (in->info.bmp3.Height <= 0) || !in->blob)
+        return write_bmp(fd, in, hdrsize);
+
+    // room for one worst case row past the raw size: encoding gives up (ENOSPC) as soon
+    //  as it can no longer come in under it
+    const uint32_t compression = (8 == bits) ? BMP_COMPRESSION_RLE8 : BMP_COMPRESSION_RLE4;
+    const size_t raw = bmp_row_stride(in) * (size_t)in->info.bmp3.Height,
+                 cb = raw + 2 * (size_t)in->info.bmp3.Width + 2;
+    unsigned char* rle = malloc(cb);
+    if (!rle)
+        return errno = ENOMEM, false;
+    size_t cbrle;
+    bool ok;
+    if (bmp_encode_rle(in, compression, rle, cb, &cbrle) && (cbrle < raw))
+        ok = write_bmp_as(fd, in, hdrsize, compression, rle, cbrle);
+    else
+        ok = write_bmp_as(fd, in, hdrsize, BMP_COMPRESSION_NONE, NULL, 0);
+    free(rle);
+    return ok;
+}
+
+bool write_bmp_path(const char* path, const UNSERIAL_BITMAP* in, uint32_t hdrsize) {
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+    bool ok = write_bmp(fd, in, hdrsize);
+    if (close(fd))
+        ok = false;
+    return ok;
+}
+
+// ===                              ===
+// ===            Packs             ===
+// ===                              ===
+//  Header: magic, version, entry count, 0. Index entries: offset (u64), size, pixels,
+//  width, height, bit count (u16), info header size (u16), compression.
+
+// pixel arrays in a pack start on this boundary, so rows can be loaded straight off the mapping
+#define BMP_PACK_ALIGN 16
+
+static bool pwrite_all(int fd, const void* buf, size_t cb, off_t offset) {
+    const unsigned char* p = buf;
+    while (cb) {
+        ssize_t done = pwrite(fd, p, cb, offset);
+        if (done < 0) {
+            if (EINTR == errno)
+                continue;
+            return false;
+        }
+        p += done, cb -= (size_t)done, offset += done;
+    }
+    return true;
+}
+
+static void pack_store_entry(unsigned char* p, const BMP_PACK_ENTRY* e) {
+    store_little_u32(p, (uint32_t)e->offset);
+    store_little_u32(p + 4, (uint32_t)(e->offset >> 32));
+    store_little_u32(p + 8, e->size);
+    store_little_u32(p + 12, e->pixels);
+    store_little_u32(p + 16, (uint32_t)e->width);
+    store_little_u32(p + 20, (uint32_t)e->height);
+    store_little_u16(p + 24, e->bit_count);
+    store_little_u16(p + 26, e->header_size);
+    store_little_u32(p + 28, e->compression);
+}
+
+static void pack_load_entry(const unsigned char* p, BMP_PACK_ENTRY* e) {
+    e->offset = load_little_u32(p) | ((uint64_t)load_little_u32(p + 4) << 32);
+    e->size = load_little_u32(p + 8);
+    e->pixels = load_little_u32(p + 12);
+    e->width = (int32_t)load_little_u32(p + 16);
+    e->height = (int32_t)load_little_u32(p + 20);
+    e->bit_count = load_little_u16(p + 24);
+    e->header_size = load_little_u16(p + 26);
+    e->compression = load_little_u32(p + 28);
+}
+
+// A source's bitmap file and its headers: the source's own bytes, or a read only mapping of
+//  its path for the caller to unmap. Files are checked as parse_bmp_memory would.
+static const unsigned char* pack_source(const BMP_BATCH_SOURCE* source, size_t* cb, UNSERIAL_BITMAP* hdr) {
+
+    const unsigned char* p = source->data;
+    *cb = source->size;
+    if (source->path) {
+        int fd = open(source->path, O_RDONLY);
+        if (fd < 0)
+            return NULL;
+        struct stat st;
+        if (fstat(fd, &st) || (st.st_size <= 0)) {
+            close(fd);
+            return errno = EBADF, NULL;
+        }
+        *cb = (size_t)st.st_size;
+        void* base = mmap(NULL, *cb, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (MAP_FAILED == base)
+            return NULL;
+        p = base;
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    int err = 0;
+    if (!p || !decode_bmp_headers(p, *cb, hdr))
+        err = p ? errno : EINVAL;
+    else if (*cb > UINT32_MAX)
+        err = EFBIG;
+    else if ((hdr->file.bmp.BlobIndex > *cb)
+        || (((BMP_COMPRESSION_RLE8 != hdr->info.bmp3.Compression) && (BMP_COMPRESSION_RLE4 != hdr->info.bmp3.Compression))
+            && (bmp_pixel_array_end(hdr) > *cb)))
+        err = EBADF;
+    if (err) {
+        if (source->path)
+            munmap((void*)p, *cb);
+        return errno = err, NULL;
+    }
+    return p;
+}
+
+bool bmp_pack_write(int fd, const BMP_BATCH_SOURCE* sources, size_t count, size_t* failed) {
+
+    if (count > (SIZE_MAX - CB_SERIALIZED_BMP_PACK_HEADER) / CB_SERIALIZED_BMP_PACK_ENTRY || (count > UINT32_MAX))
+        return errno = EFBIG, false;
+    const size_t cbindex = CB_SERIALIZED_BMP_PACK_HEADER + count * CB_SERIALIZED_BMP_PACK_ENTRY;
+    unsigned char* index = calloc(1, cbindex);
+    if (!index)
+        return errno = ENOMEM, false;
+    store_little_u32(index, BMP_PACK_MAGIC);
+    store_little_u32(index + 4, BMP_PACK_VERSION);
+    store_little_u32(index + 8, (uint32_t)count);
+
+    // files go in after the index, padding between them left as holes
+    bool ok = !ftruncate(fd, 0);
+    uint64_t end = cbindex;
+    size_t i = 0;
+    for (; ok && (i < count); ++i) {
+        size_t cb;
+        UNSERIAL_BITMAP hdr;
+        const unsigned char* p = pack_source(&sources[i], &cb, &hdr);
+        if (!p) {
+            ok = false;
+            break;
+        }
+        BMP_PACK_ENTRY e;
+        e.offset = end + (BMP_PACK_ALIGN - (end + hdr.file.bmp.BlobIndex) % BMP_PACK_ALIGN) % BMP_PACK_ALIGN;
+        e.size = (uint32_t)cb;
+        e.pixels = hdr.file.bmp.BlobIndex;
+        e.width = hdr.info.bmp3.Width;
+        e.height = hdr.info.bmp3.Height;
+        e.bit_count = hdr.info.bmp3.BitCount;
+        e.header_size = (uint16_t)hdr.info.hdrsize;
+        e.compression = hdr.info.bmp3.Compression;
+        ok = pwrite_all(fd, p, cb, (off_t)e.offset);
+        if (sources[i].path) {
+            const int err = errno;
+            munmap((void*)p, cb);
+            errno = err;
+        }
+        if (!ok)
+            break;
+        pack_store_entry(index + CB_SERIALIZED_BMP_PACK_HEADER + i * CB_SERIALIZED_BMP_PACK_ENTRY, &e);
+        end = e.offset + cb;
+    }
+    ok = ok && pwrite_all(fd, index, cbindex, 0);
+
+    const int err = errno;
+    free(index);
+    if (!ok && failed)
+        *failed = i;
+    return errno = err, ok;
+}
+
+bool bmp_pack_open(BMP_PACK* pack, const char* path, const BMP_ALLOCATOR* allocator) {
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) || (st.st_size < CB_SERIALIZED_BMP_PACK_HEADER)) {
+        close(fd);
+        return errno = EBADF, false;
+    }
+    const size_t cb = (size_t)st.st_size;
+    void* base = mmap(NULL, cb, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == base)
+        return false;
+    // the pack is usually read end to end at startup: ask for all of it up front
+    posix_madvise(base, cb, POSIX_MADV_WILLNEED);
+
+    const unsigned char* p = base;
+    const size_t count = load_little_u32(p + 8);
+    BMP_PACK_ENTRY* entries = NULL;
+    int err = 0;
+    if ((BMP_PACK_MAGIC != load_little_u32(p)) || (count > (cb - CB_SERIALIZED_BMP_PACK_HEADER) / CB_SERIALIZED_BMP_PACK_ENTRY))
+        err = EBADF;
+    else if (BMP_PACK_VERSION != load_little_u32(p + 4))
+        err = ENOTSUP;
+    else if (count && !(entries = bmp_alloc(allocator, count * sizeof(BMP_PACK_ENTRY))))
+        err = ENOMEM;
+    // entries are checked once here, so lookups can trust them
+    for (size_t i = 0; !err && (i < count); ++i) {
+        BMP_PACK_ENTRY* e = &entries[i];
+        pack_load_entry(p + CB_SERIALIZED_BMP_PACK_HEADER + i * CB_SERIALIZED_BMP_PACK_ENTRY, e);
+        if ((e->offset > cb) || (e->size > cb - e->offset) || (e->pixels > e->size))
+            err = EBADF;
+    }
+    if (err) {
+        bmp_free(allocator, entries);
+        munmap(base, cb);
+        return errno = err, false;
+    }
+
+    pack->base = p;
+    pack->size = cb;
+    pack->count = count;
+    pack->entries = entries;
+    pack->allocator = allocator;
+    return true;
+}
+
+void bmp_pack_close(BMP_PACK* pack) {
+    if (pack->base)
+        munmap((void*)pack->base, pack->size);
+    bmp_free(pack->allocator, pack->entries);
+    pack->base = NULL;
+    pack->size = 0;
+    pack->count = 0;
+    pack->entries = NULL;
+}
+
+const void* bmp_pack_data(const BMP_PACK* pack, size_t id, size_t* size) {
+    if (id >= pack->count)
+        return errno = ENOENT, NULL;
+    *size = pack->entries[id].size;
+    return pack->base + pack->entries[id].offset;
+}
+
+bool bmp_pack_decode(BMP_DECODER* dec, const BMP_PACK* pack, size_t id, BMP_IMAGE* out) {
+    if (id >= pack->count)
+        return decoder_fail(dec, BMP_ERR_ARGUMENT, ENOENT);
+    return bmp_decoder_decode_memory(dec, pack->base + pack->entries[id].offset, pack->entries[id].size, out);
+}
+
+// ===                              ===
+// ===       Terminal preview       ===
+// ===                              ===
+
+// Colors are packed R | G << 8 | B << 16; TERM_DEFAULT is the terminal's own
+#define TERM_DEFAULT 0xFFFFFFFFU
+// Longest cell: both colors set by one escape, then a 3 byte glyph
+#define TERM_CELL_MAX (sizeof("\33[38;2;255;255;255;48;2;255;255;255m") - 1 + 3)
+// Every line ends with attributes reset, so the background stops at the image
+#define TERM_EOL "\33[0m\n"
+#define TERM_UPPER_HALF "\xE2\x96\x80"
+#define TERM_LOWER_HALF "\xE2\x96\x84"
+#define TERM_FULL_BLOCK "\xE2\x96\x88"
+
+static char* term_rgb(char* o, uint32_t c) {
+    for (unsigned shift = 0; shift < 24; shift += 8) {
+        const unsigned v = (c >> shift) & 0xFF;
+        if (v >= 100)
+            *o++ = (char)('0' + v / 100);
+        if (v >= 10)
+            *o++ = (char)('0' + v / 10 % 10);
+        *o++ = (char)('0' + v % 10);
+        *o++ = ';';
+    }
+    return o - 1;
+}
+
+// One SGR escape for whichever of the colors changes, nothing when neither does
+static char* term_colors(char* o, uint32_t* fg, uint32_t* bg, uint32_t want_fg, uint32_t want_bg) {
+
+    const bool set_fg = want_fg != *fg, set_bg = want_bg != *bg;
+    if (!set_fg && !set_bg)
+        return o;
+    *o++ = '\33', *o++ = '[';
+    if (set_fg) {
+        memcpy(o, "38;2;", 5);
+        o = term_rgb(o + 5, want_fg);
+    }
+    if (set_bg) {
+        if (set_fg)
+            *o++ = ';';
+        if (TERM_DEFAULT == want_bg)
+            *o++ = '4', *o++ = '9';
+        else {
+            memcpy(o, "48;2;", 5);
+            o = term_rgb(o + 5, want_bg);
+        }
+    }
+    *o++ = 'm';
+    *fg = want_fg, *bg = want_bg;
+    return o;
+}
+
+// One line of cells: top[] over bottom[] (NULL for the lower half of an odd last row).
+//  Glyphs are picked so the colors already set are reused where they can be.
+static char* term_line(char* o, const uint32_t* top, const uint32_t* bottom, size_t width) {
+
+    uint32_t fg = TERM_DEFAULT, bg = TERM_DEFAULT;
+    for (size_t x = 0; x < width; ++x) {
+        const uint32_t t = top[x], b = bottom ? bottom[x] : TERM_DEFAULT;
+        if (t == b) {
+            if (bg == t)
+                *o++ = ' ';
+            else if (fg == t)
+                memcpy(o, TERM_FULL_BLOCK, 3), o += 3;
+            else {
+                o = term_colors(o, &fg, &bg, fg, t);
+                *o++ = ' ';
+            }
+        }
+        else if ((fg == b) && (bg == t) && bottom)
+            memcpy(o, TERM_LOWER_HALF, 3), o += 3;
+        else {
+            o = term_colors(o, &fg, &bg, t, b);
+            memcpy(o, TERM_UPPER_HALF, 3), o += 3;
+        }
+    }
+    memcpy(o, TERM_EOL, sizeof(TERM_EOL) - 1);
+    return o + sizeof(TERM_EOL) - 1;
+}
+
+bool bmp_render_terminal(int fd, const UNSERIAL_BITMAP* in, unsigned columns, unsigned rows) {
+
+    if (!in->blob || (in->info.bmp3.Width <= 0) || !in->info.bmp3.Height)
+        return errno = EINVAL, false;
+    if (!columns || !rows) {
+        struct winsize ws;
+        const bool tty = !ioctl(fd, TIOCGWINSZ, &ws) && ws.ws_col && ws.ws_row;
+        if (!columns)
+            columns = tty ? ws.ws_col : 80;
+        if (!rows)
+            rows = tty ? ws.ws_row : 24;
+    }
+
+    // fit columns x 2 pixels per line, a line left for the prompt; never enlarged
+    const size_t width = (size_t)in->info.bmp3.Width, height = (size_t)abs(in->info.bmp3.Height),
+                 max_w = columns, max_h = 2 * (size_t)((rows > 1) ? rows - 1 : 1);
+    size_t ow = width, oh = height;
+    if (ow > max_w)
+        oh = (height * max_w + width / 2) / width, ow = max_w;
+    if (oh > max_h)
+        ow = (width * max_h + height / 2) / height, oh = max_h;
+    ow = ow ? ((ow < max_w) ? ow : max_w) : 1;
+    oh += !oh;
+
+    // converter, one source row, the sums of an output row, two output rows, then the text
+    const size_t lines = (oh + 1) / 2, cbtext = lines * (ow * TERM_CELL_MAX + sizeof(TERM_EOL) - 1),
+                 cbrow = (width * 4 + 15) & ~(size_t)15;
+    unsigned char* block = bmp_alloc(in->allocator, sizeof(BMP_CONVERTER) + cbrow + ow * 4 * sizeof(uint64_t) + 2 * ow * sizeof(uint32_t) + cbtext);
+    if (!block)
+        return errno = ENOMEM, false;
+    BMP_CONVERTER* cv = (BMP_CONVERTER*)block;
+    unsigned char* rgba = block + sizeof(BMP_CONVERTER);
+    uint64_t* sums = (uint64_t*)(rgba + cbrow);
+    uint32_t* pixels[2] = { (uint32_t*)(sums + ow * 4), (uint32_t*)(sums + ow * 4) + ow };
+    char* text = (char*)(pixels[1] + ow), *o = text;
+    // transparency comes out composited over black
+    if (!bmp_converter_init(cv, in, BMP_FORMAT_RGBA8_PREMULTIPLIED)) {
+        bmp_free(in->allocator, block);
+        return false;
+    }
+
+    // output pixel (ox, oy) averages source columns [ox * width / ow, (ox + 1) * width / ow)
+    //  of rows [oy * height / oh, (oy + 1) * height / oh)
+    memset(sums, 0, ow * 4 * sizeof(uint64_t));
+    size_t oy = 0, taken = 0, next = height / oh;
+    for (size_t y = 0; y < height; ++y) {
+        const size_t file_row = (in->info.bmp3.Height > 0) ? height - 1 - y : y;
+        cv->row(cv, in->blob + file_row * in->stride, rgba, width);
+        const unsigned char* px = rgba;
+        for (size_t ox = 0, x = 0; ox < ow; ++ox) {
+            uint64_t* sum = sums + ox * 4;
+            for (const size_t x1 = (ox + 1) * width / ow; x < x1; ++x, px += 4)
+                sum[0] += px[0], sum[1] += px[1], sum[2] += px[2];
+        }
+        ++taken;
+        if (y + 1 < next)
+            continue;
+
+        uint32_t* out = pixels[oy & 1];
+        for (size_t ox = 0; ox < ow; ++ox) {
+            const uint64_t n = taken * ((ox + 1) * width / ow - ox * width / ow);
+            uint64_t* sum = sums + ox * 4;
+            out[ox] = (uint32_t)((sum[0] + n / 2) / n) | (uint32_t)((sum[1] + n / 2) / n) << 8 | (uint32_t)((sum[2] + n / 2) / n) << 16;
+            sum[0] = sum[1] = sum[2] = 0;
+        }
+        if (oy & 1)
+            o = term_line(o, pixels[0], pixels[1], ow);
+        taken = 0;
+        next = (++oy + 1) * height / oh;
+    }
+    if (oh & 1)
+        o = term_line(o, pixels[0], NULL, ow);
+
+    struct iovec iov = { .iov_base = text, .iov_len = (size_t)(o - text) };
+    const bool ok = writev_all(fd, &iov, 1);
+    bmp_free(in->allocator, block);
+    return ok;
+}
+
+bool blit_console(const UNSERIAL_BITMAP* in) {
+    // anything still buffered in stdout goes first
+    fflush(stdout);
+    return bmp_render_terminal(STDOUT_FILENO, in, 0, 0);
+}
+
+#ifndef BMPLIB_NO_MAIN
+int main() {
+    
+    FILE* fp = fopen("ie.bmp", "r");
+    if (feof(fp)) {
+        printf("\nbad file");
+        return 0;
+    }
+    printf("\nfile open.");
+    UNSERIAL_BITMAP a ={0};
+    parse_bmp(fp, &a);
+    blit_console(&a);
+    fclose(fp);
+    return 0;
+}
+#endif // BMPLIB_NO_MAIN
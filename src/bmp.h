@@ -1,7 +1,11 @@
+#ifndef BMPLIB_BMP_H
+#define BMPLIB_BMP_H
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <pthread.h>
 
 
 // Formats are listed in chronological order due to lots of reverse referencing
@@ -37,7 +41,7 @@
 // Default values for bitmap bitfield masks (3.0 NT compression = BITFIELDS)
 
 // 16bits RGB565
-#define BMP_BITFIELD_RGB565_RED(u)    ((0xF8000000UL & u) >> (11 + 16)
+#define BMP_BITFIELD_RGB565_RED(u)    ((0xF8000000UL & u) >> (11 + 16))
 #define BMP_BITFIELD_RGB565_GREEN(u)  ((0x07E00000UL & u) >> (5 + 16))
 #define BMP_BITFIELD_RGB656_BLUE(u)   ((0x001F0000UL & u) >> (0 + 16))
 
@@ -116,10 +120,7 @@ typedef struct
 
 // Special case / todo:
 //      [ ] Windows CE, Pocket PC Bitmap, 2 bits / pixel
-//      [ ] OS/2 may parse identically. 
-//      [ ]     Workaround: 
-//                  if biCompress is 3 or 4
-//                      3: if BitCount is 
+//      [ ] OS/2 2.x 64 byte headers (Huffman 1D, RLE24).
 //
 typedef struct {
     uint32_t Size; // 4 Header size in bytes
@@ -153,16 +154,61 @@ typedef struct {
     uint32_t BlueMask;      // bits of blue
 } UNSERIAL_BITMAPNTINFOHEADER; // V3
 
-// --                   --
-// -- deprecated format --
-// --                   -- 
-// 
+// v4 / v5 color space (->CSType) and v5 rendering intent (->Intent)
+#ifndef LCS_sRGB
+#define LCS_CALIBRATED_RGB      0x00000000U     // endpoints and gamma in the header
+#define LCS_sRGB                0x73524742U     // 'sRGB'
+#define LCS_WINDOWS_COLOR_SPACE 0x57696E20U     // 'Win ', the system default
+#define PROFILE_LINKED          0x4C494E4BU     // 'LINK', ProfileData names an ICC file
+#define PROFILE_EMBEDDED        0x4D424544U     // 'MBED', ProfileData holds an ICC profile
+#define LCS_GM_BUSINESS         1U
+#define LCS_GM_GRAPHICS         2U
+#define LCS_GM_IMAGES           4U
+#define LCS_GM_ABS_COLORIMETRIC 8U
+#endif
+
+// CIE XYZ coordinates in 2.30 fixed point
 typedef struct {
+    int32_t X;
+    int32_t Y;
+    int32_t Z;
+} BMP_CIEXYZ;
 
-} DESERIAL_BITMAPV4INFOHEADER;
+typedef struct {
+    BMP_CIEXYZ Red;
+    BMP_CIEXYZ Green;
+    BMP_CIEXYZ Blue;
+} BMP_CIEXYZTRIPLE;
 
-typedef struct
-{   uint32_t Size; // 4 Header size in bytes
+// Windows 95 / NT 4: v3 plus masks (always present, used with BITFIELDS), alpha and color space
+typedef struct {
+    uint32_t Size; // 4 Header size in bytes
+    int32_t  Width; // 4 Width of image 
+    int32_t  Height; // 4 Height of image
+    uint16_t Planes; // 2 Number of colour planes
+    uint16_t BitCount; // 2 Bits per pixel
+    uint32_t Compression; // 4 Compression type ( 1 = 8bit RLE, 2 = 4bit RLE, 3 = Windows NT )
+    uint32_t SizeImage; // 4 /* Image size in uint8_ts
+    int32_t  XPxPerMeter; // 4 Horizontal resolution
+    int32_t  YPxPerMeter; // 4 Vertical resolution
+    uint32_t ClrUsed; // 4 /* Number of colours
+    uint32_t ClrImportant; // 4 /* Important colours
+    uint32_t RedMask;       // Bits of red
+    uint32_t GreenMask;     // bits of green
+    uint32_t BlueMask;      // bits of blue
+    uint32_t AlphaMask;     // bits of alpha, 0 for opaque
+    uint32_t CSType;        // LCS_* / PROFILE_*
+    BMP_CIEXYZTRIPLE Endpoints;     // LCS_CALIBRATED_RGB only
+    uint32_t GammaRed;      // 16.16 fixed point, LCS_CALIBRATED_RGB only
+    uint32_t GammaGreen;
+    uint32_t GammaBlue;
+} UNSERIAL_BITMAPV4INFOHEADER;
+
+typedef UNSERIAL_BITMAPV4INFOHEADER WIN4XBITMAPHEADER;
+
+// Windows 98 / 2000: v4 plus rendering intent and an ICC profile, linked or embedded
+typedef struct {
+    uint32_t Size; // 4 Header size in bytes
     int32_t  Width; // 4 Width of image 
     int32_t  Height; // 4 Height of image
     uint16_t Planes; // 2 Number of colour planes
@@ -176,41 +222,17 @@ typedef struct
     uint32_t RedMask;       // Bits of red
     uint32_t GreenMask;     // bits of green
     uint32_t BlueMask;      // bits of blue
-    uint32_t AlphaMask;     /* Mask identifying bits of alpha component */
-    uint32_t CSType;        /* Color space type */
-    int16_t  RedX;          /* X coordinate of red endpoint */
-    int16_t  RedY;          /* Y coordinate of red endpoint */
-    int16_t  RedZ;          /* Z coordinate of red endpoint */
-    int16_t  GreenX;        /* X coordinate of green endpoint */
-    int16_t  GreenY;        /* Y coordinate of green endpoint */
-    int16_t  GreenZ;        /* Z coordinate of green endpoint */
-    int16_t  BlueX;         /* X coordinate of blue endpoint */
-    int16_t  BlueY;         /* Y coordinate of blue endpoint */
-    int16_t  BlueZ;         /* Z coordinate of blue endpoint */
-    uint32_t GammaRed;      /* Gamma red coordinate scale value */
-    uint32_t GammaGreen;    /* Gamma green coordinate scale value */
-    uint32_t GammaBlue;     /* Gamma blue coordinate scale value */
-} WIN4XBITMAPHEADER;
-
-
-/*
-typedef struct {
-  UNSERIAL_BITMAPINFOHEADER old_header;
-  uint32_t     RedMask;
-  uint32_t     GreenMask;
-  uint32_t     BlueMask;
-  uint32_t     AphaMask;
-  uint32_t     CSType;
-  CIEXYZTRIPLE Endpoints;
-  uint32_t     GammaRed;
-  uint32_t     GammaGreen;
-  uint32_t     GammaBlue;
-  uint32_t     Intent;
-  uint32_t     ProfileData;
-  uint32_t     ProfileSize;
-  uint32_t     Reserved;
+    uint32_t AlphaMask;     // bits of alpha, 0 for opaque
+    uint32_t CSType;        // LCS_* / PROFILE_*
+    BMP_CIEXYZTRIPLE Endpoints;
+    uint32_t GammaRed;
+    uint32_t GammaGreen;
+    uint32_t GammaBlue;
+    uint32_t Intent;        // LCS_GM_*
+    uint32_t ProfileData;   // offset of the profile from the start of this header
+    uint32_t ProfileSize;   // bytes of profile data (a file name for PROFILE_LINKED)
+    uint32_t Reserved;
 } UNSERIAL_BITMAPV5INFOHEADER;
-*/
 
 typedef struct {
     unsigned char    rgbBlue;   
@@ -219,6 +241,36 @@ typedef struct {
     unsigned char    rgbReserved;
 } RGBQUAD;
 
+// ===                              ===
+// ===          Allocation          ===
+// ===                              ===
+//  Everything the parsers hand back in an UNSERIAL_BITMAP (blob, palette) and their
+//  per call scratch comes from its ->allocator, or malloc / free when that is NULL.
+typedef struct {
+    void* (*alloc)(void* user, size_t cb);
+    void (*release)(void* user, void* p);
+    void* user;
+} BMP_ALLOCATOR;
+
+extern const BMP_ALLOCATOR bmp_default_allocator;
+
+// Thread safe pool of reusable blocks keyed by size class (four per power of two).
+//  Released blocks are kept, up to max_cached bytes, and handed out again for any request
+//  of their class, so decoding same sized frames stops touching the heap once warm.
+#define BMP_POOL_CLASSES 240
+typedef struct {
+    BMP_ALLOCATOR allocator;    // give this to the parsers, user points back at the pool
+    size_t max_cached;          // bytes kept on free lists, anything beyond is freed
+    size_t cached;
+    size_t heap_allocs;         // blocks that had to come from malloc
+    void* free[BMP_POOL_CLASSES];
+    pthread_mutex_t lock;
+} BMP_POOL;
+
+bool bmp_pool_init(BMP_POOL* pool, size_t max_cached);
+// Frees every cached block. Blocks still out must not be released to the pool afterwards.
+void bmp_pool_destroy(BMP_POOL* pool);
+
 typedef struct {
     union {
         uint16_t signature;
@@ -230,10 +282,448 @@ typedef struct {
         UNSERIAL_BITMAPV2INFOHEADER bmp2;
         UNSERIAL_BITMAPINFOHEADER bmp3;
         UNSERIAL_BITMAPNTINFOHEADER bmp3_nt;
+        UNSERIAL_BITMAPV4INFOHEADER bmp4;
+        UNSERIAL_BITMAPV5INFOHEADER bmp5;
     } info;
     struct {
         size_t count;
         RGBQUAD* array;
     } palette;
     unsigned char* blob;
+    size_t stride;          // bytes between the starts of consecutive rows in blob
+    // set when blob is a view rather than a heap copy: into the caller's buffer
+    //  (parse_bmp_memory) or into ->mapping
+    bool borrowed;
+    // set when out owns a mapping of the file (parse_bmp_mapped): blob's, or an RLE
+    //  image's kept for its ICC profile
+    struct {
+        void* base;
+        size_t size;
+    } mapping;
+    // where blob / palette come from and go back to; set before parsing, NULL for malloc
+    const BMP_ALLOCATOR* allocator;
+    // budgets per image, set before parsing, 0 for none (see Reading)
+    uint64_t max_pixels;
+    size_t max_bytes;
 } UNSERIAL_BITMAP;
+
+// ===                              ===
+// ===           Reading            ===
+// ===                              ===
+//  All parsers return false and set errno on failure; out is only valid on success.
+//  Pixel rows in blob are kept in file order (bottom-up when Height > 0).
+//  The color table, if any, is copied to ->palette (OS/2 core header triples widened to
+//  RGBQUADs).
+//  Windows 1.x .DDB and OS/2 1.x core header (12 byte) files decode through the same paths:
+//  their headers are widened into ->info.bmp3 (core: 16 bit unsigned sizes, bottom-up,
+//  uncompressed; DDB: top-down, uncompressed, ->info.hdrsize CB_SERIALIZED_BITMAPV1FILEHEADER
+//  and the original header in ->file.ddb). DDBs have no color table; their indices are
+//  mapped by bmp_palette_init.
+//  Headers are checked before anything is allocated for the pixels: bit depth and
+//  compression must agree, the pixel array must lie past the headers and fit in memory
+//  arithmetic, and uncompressed pixel arrays must be present in full. Images of more than
+//  BMP_MAX_PIXELS pixels (0 for no ceiling) are refused with EFBIG.
+#ifndef BMP_MAX_PIXELS
+#define BMP_MAX_PIXELS ((uint64_t)1 << 30)
+#endif
+//  Below that, ->max_pixels and ->max_bytes, set before parsing like ->allocator, are
+//  budgets per image: more pixels, or more bytes than the parser would allocate for the
+//  pixel array (compressed data included for RLE), are refused with EFBIG too.
+
+bool parse_bmp(FILE* bmp_read, UNSERIAL_BITMAP* out);
+
+// Decodes headers straight out of a buffer holding a whole bitmap file.
+//  For uncompressed images blob is a view into data (no copy, ->borrowed set), rows
+//  stride bytes apart including padding, so data must outlive out. free_bmp releases
+//  whatever out does own (an RLE decoded blob, the palette).
+bool parse_bmp_memory(const void* data, size_t cb, UNSERIAL_BITMAP* out);
+// parse_bmp_memory over a private mapping of path. The mapping is owned by out, and kept
+//  in ->mapping for uncompressed images and for any image with an ICC profile.
+bool parse_bmp_mapped(const char* path, UNSERIAL_BITMAP* out);
+
+// Where the ICC profile of a v5 bitmap (CSType PROFILE_EMBEDDED, or the file name of a
+//  PROFILE_LINKED one) lies in its file: *size bytes from *offset, counted from the start
+//  of the file. Nothing is read or copied; pread the range, or slice it out of a mapping
+//  with bmp_icc_profile_view. False with errno ENOENT when there is none.
+bool bmp_icc_profile(const UNSERIAL_BITMAP* hdr, uint64_t* offset, uint32_t* size);
+// The profile as a pointer into the cb bytes of file at data (a parse_bmp_mapped image's
+//  ->mapping, kept whenever there is a profile, or a parse_bmp_memory buffer). NULL with errno ENOENT when there is none,
+//  EBADF when it runs past the data.
+const void* bmp_icc_profile_view(const UNSERIAL_BITMAP* hdr, const void* data, size_t cb, uint32_t* size);
+
+// Decodes a whole RLE8 / RLE4 compressed pixel array (hdr->info.bmp3.Compression)
+//  into rows of bmp_row_bytes(hdr), dst_stride apart, bottom row first like the file.
+//  Runs are bounds checked against Width / Height; skipped pixels become index 0.
+bool bmp_decode_rle(const void* src, size_t cb, const UNSERIAL_BITMAP* hdr, unsigned char* dst, size_t dst_stride);
+// The other way: in's rows of indices (->blob, file order, ->stride apart; 8bpp for
+//  RLE8, 4bpp for RLE4, bottom-up only) to a compression stream in the cb bytes at dst,
+//  its length in *written. Runs are found a vector at a time; repeats too short to pay
+//  for themselves stay in absolute runs. bmp_rle_bound(in) bytes always suffice (0 when
+//  that overflows); with fewer, encoding stops with ENOSPC once less than a worst case
+//  row (2 * width + 2 bytes) is left.
+size_t bmp_rle_bound(const UNSERIAL_BITMAP* in);
+bool bmp_encode_rle(const UNSERIAL_BITMAP* in, uint32_t compression, void* dst, size_t cb, size_t* written);
+
+// Bitfield (and 16 / 32bpp uncompressed) pixels to canonical RGBA8, bytes R G B A.
+//  Shifts and scales are worked out once per image; channels narrower than 8 bits are
+//  scaled by bit replication, wider ones are truncated. No alpha mask means opaque.
+typedef struct BMP_BITFIELDS BMP_BITFIELDS;
+struct BMP_BITFIELDS {
+    uint32_t mask[4];           // R G B A
+    uint8_t rshift[4];          // (px & mask) >> rshift << lshift lands a channel's
+    uint8_t lshift[4];          //  top 8 bits in bits 0..7
+    uint8_t replicate[4];       // channel width, capped at 8
+    uint32_t opaque;            // ORed into every pixel when there is no alpha mask
+    unsigned bpp;               // 16 or 32
+    // widest kernel the cpu supports, picked by bmp_bitfields_init
+    void (*row)(const BMP_BITFIELDS* bf, const unsigned char* src, unsigned char* rgba, size_t width);
+};
+
+// Takes masks from hdr for BITFIELDS images, the 5-5-5 / 8-8-8 defaults otherwise
+bool bmp_bitfields_init(BMP_BITFIELDS* bf, const UNSERIAL_BITMAP* hdr);
+// Expands width pixels of one row
+void bmp_bitfields_row(const BMP_BITFIELDS* bf, const unsigned char* src, unsigned char* rgba, size_t width);
+
+// Indexed (1 / 2 / 4 / 8bpp) pixels expanded through the color table to RGB8 or RGBA8.
+//  Whole source bytes are looked up at once: a byte yields 8 pixels at 1bpp, 4 at 2bpp
+//  and 2 at 4bpp. Indices past the end of the color table come out black. DDBs map
+//  through a stand-in for the display palette: black / white, the 16 color system
+//  palette, or gray levels at 8bpp.
+typedef struct BMP_PALETTE_LUT BMP_PALETTE_LUT;
+struct BMP_PALETTE_LUT {
+    unsigned bpp;               // 1, 2, 4 or 8
+    unsigned channels;          // 3 (RGB8) or 4 (RGBA8)
+    uint32_t color[256];        // RGBA8 per index, in memory order
+    unsigned char expand[256 * 8 * 4];  // source byte -> its pixels, 1 / 2 / 4bpp only
+    // widest kernel the cpu supports, picked by bmp_palette_init
+    void (*row)(const BMP_PALETTE_LUT* lut, const unsigned char* src, unsigned char* dst, size_t width);
+};
+
+bool bmp_palette_init(BMP_PALETTE_LUT* lut, const UNSERIAL_BITMAP* hdr, unsigned channels);
+void bmp_palette_row(const BMP_PALETTE_LUT* lut, const unsigned char* src, unsigned char* dst, size_t width);
+
+// Output layouts for the conversion stage. Byte order as named (RGBA8 is R G B A in memory).
+//  GRAY8 is BT.601 luma. PLANAR_F32 is three planes R, G, B of floats in [0, 1],
+//  each plane_stride bytes after the last. Alpha is straight (as bitmaps store it) except
+//  in the _PREMULTIPLIED layouts, which have it multiplied into the color channels; for
+//  images without an alpha mask the two are the same and cost the same.
+typedef enum {
+    BMP_FORMAT_RGBA8,
+    BMP_FORMAT_BGRA8,
+    BMP_FORMAT_RGB8,
+    BMP_FORMAT_GRAY8,
+    BMP_FORMAT_PLANAR_F32,
+    BMP_FORMAT_RGBA8_PREMULTIPLIED,
+    BMP_FORMAT_BGRA8_PREMULTIPLIED,
+} BMP_PIXEL_FORMAT;
+
+// bytes per pixel of a format (per plane for planar formats)
+size_t bmp_format_bytes(BMP_PIXEL_FORMAT format);
+
+// Converts decoded rows of one image to an output layout in a single pass. Common sources
+//  have direct kernels, looked up once per image in a table by source layout and format
+//  and picked for the running cpu (SSSE3 / AVX2 / AVX-512 on x86, NEON on AArch64); the
+//  rest are expanded through RGBA8 a few pixels at a time on the stack, so a converter is
+//  immutable after init and can be shared between threads.
+typedef struct BMP_CONVERTER BMP_CONVERTER;
+struct BMP_CONVERTER {
+    BMP_PIXEL_FORMAT format;
+    unsigned bpp;               // source bits per pixel
+    size_t plane_stride;        // planar formats only
+    union {
+        BMP_BITFIELDS bitfields;
+        BMP_PALETTE_LUT palette;
+    } source;
+    // source -> RGBA8, for the staged path
+    void (*stage)(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* rgba, size_t width);
+    // source -> format
+    void (*row)(const BMP_CONVERTER* cv, const unsigned char* src, unsigned char* dst, size_t width);
+};
+
+bool bmp_converter_init(BMP_CONVERTER* cv, const UNSERIAL_BITMAP* hdr, BMP_PIXEL_FORMAT format);
+// Converts width pixels of one blob row to dst
+void bmp_convert_row(const BMP_CONVERTER* cv, const unsigned char* src, void* dst, size_t width);
+// Whole image: blob rows (any stride / padding) to dst rows dst_stride apart, top-down
+//  or bottom-up as asked regardless of the file's orientation.
+bool bmp_convert(const UNSERIAL_BITMAP* in, BMP_PIXEL_FORMAT format, bool top_down, void* dst, size_t dst_stride);
+
+// Banded parallel decode of uncompressed / bitfield images. The pixel array is split into
+//  bands of rows, read with pread on the shared fd (and converted) by up to workers
+//  threads, 0 meaning one per online cpu. fd's file position is left alone.
+bool parse_bmp_parallel(int fd, UNSERIAL_BITMAP* out, unsigned workers);
+// Read and convert in one pass, straight into dst as bmp_convert would lay it out.
+//  hdr (may be NULL) brings ->allocator and ->max_pixels and receives ->file, ->info and
+//  ->palette, blob stays NULL.
+bool parse_bmp_convert_parallel(int fd, BMP_PIXEL_FORMAT format, bool top_down, void* dst, size_t dst_stride, unsigned workers, UNSERIAL_BITMAP* hdr);
+// bmp_convert across workers threads
+bool bmp_convert_parallel(const UNSERIAL_BITMAP* in, BMP_PIXEL_FORMAT format, bool top_down, void* dst, size_t dst_stride, unsigned workers);
+
+// Header-only parse: fills ->file and ->info (masks included) without touching
+//  the color table or pixel array; blob stays NULL.
+bool probe_bmp(FILE* bmp_read, UNSERIAL_BITMAP* out);
+bool probe_bmp_path(const char* path, UNSERIAL_BITMAP* out);
+// Probes count paths across workers threads (0 = one per online cpu).
+//  out[i] / ok[i] (ok may be NULL) receive each result; failed entries are zeroed.
+//  Returns the number of files probed successfully.
+size_t probe_bmp_batch(const char* const* paths, size_t count, UNSERIAL_BITMAP* out, bool* ok, unsigned workers);
+
+// Pull style scanline iterator over uncompressed images with bounded memory.
+//  Rows come out top-down whatever the sign of Height. Only a ring of capacity rows
+//  is resident: rows handed out stay valid until capacity further rows have been read.
+typedef struct {
+    FILE* read;
+    UNSERIAL_BITMAP hdr;    // ->file and ->info of the open image, blob unused
+    size_t row_bytes;       // pixel bytes per row
+    size_t stride;          // ring and on disk bytes per row
+    size_t rows;            // abs(Height)
+    size_t next;            // next top-down row to be read
+    size_t capacity;        // rows in ring
+    unsigned char* ring;
+} BMP_ROW_READER;
+
+bool bmp_rows_open(BMP_ROW_READER* reader, FILE* bmp_read, size_t capacity);
+// Reads up to n (at most capacity) rows, storing a pointer to each in rows[].
+//  Returns the number of rows read, 0 at end of image or on error (errno set).
+size_t bmp_rows_next(BMP_ROW_READER* reader, size_t n, const unsigned char** rows);
+void bmp_rows_close(BMP_ROW_READER* reader);
+
+// ===                              ===
+// ===           Decoder            ===
+// ===                              ===
+//  Reusable decoding context. One per thread: it keeps its scratch and output buffers
+//  between images and only grows them, so a worker decoding a stream of files settles
+//  into zero allocations. Nothing in the library keeps global state, so any number of
+//  decoders can run concurrently.
+
+typedef enum {
+    BMP_OK,
+    BMP_ERR_IO,             // read failed, or the file is shorter than its headers say
+    BMP_ERR_MAGIC,          // not a bitmap file
+    BMP_ERR_HEADER,         // header fields out of range or inconsistent
+    BMP_ERR_UNSUPPORTED,    // well formed, but a variant this library does not decode
+    BMP_ERR_LIMIT,          // over the decoder's size limits or budgets
+    BMP_ERR_NOMEM,
+    BMP_ERR_CORRUPT,        // compressed pixel data does not fit the image
+    BMP_ERR_ARGUMENT,       // bad options, or a region outside the image
+} BMP_STATUS;
+
+const char* bmp_status_string(BMP_STATUS status);
+
+typedef struct {
+    BMP_PIXEL_FORMAT format;    // output layout
+    bool top_down;              // output row order, whatever the file's
+    uint32_t max_width;         // images larger than this are refused, 0 for no limit
+    uint32_t max_height;
+    // Budgets per image, 0 for none. Both are checked before the decoder allocates for an
+    //  image, so hostile headers cost neither memory nor time.
+    uint64_t max_pixels;        // source pixels read (the window's, for region decodes)
+    size_t max_bytes;           // output and scratch buffers the image needs, together
+} BMP_DECODE_OPTIONS;
+
+// A decoded image. pixels belongs to the decoder and stays valid until its next decode.
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    size_t stride;              // bytes per output row (per plane row for planar formats)
+    BMP_PIXEL_FORMAT format;
+    void* pixels;
+} BMP_IMAGE;
+
+// Rectangle of an image, in top-down coordinates whatever the file's row order
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} BMP_REGION;
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+} BMP_DECODER_BUFFER;
+
+// Decoder instrumentation: counted when the library is built with -DBMP_INSTRUMENT, left
+//  at zero (and costing nothing) otherwise
+typedef enum {
+    BMP_STAGE_HEADERS,      // file / info headers and color table, read and checked
+    BMP_STAGE_SETUP,        // limits, converter and buffers
+    BMP_STAGE_READ,         // pixel array reads and seeks
+    BMP_STAGE_RLE,          // RLE streams expanded to indices
+    BMP_STAGE_CONVERT,      // rows to the output format, realigning odd bit offsets
+    BMP_STAGE_SCALE,        // downscaling
+    BMP_STAGE_COUNT
+} BMP_STAGE;
+
+typedef struct {
+    uint64_t ns[BMP_STAGE_COUNT];       // wall time per stage
+    uint64_t bytes_read;                // from files; memory sources count none
+    uint64_t reads;                     // fread / pread calls issued
+    uint64_t seeks;
+    uint64_t allocations;               // trips to the allocator
+    uint64_t bytes_allocated;
+    uint64_t decodes;
+    uint64_t failures;
+} BMP_STATS;
+
+const char* bmp_stage_name(BMP_STAGE stage);
+// Adds from to into, e.g. to total per thread decoders for an exporter
+void bmp_stats_merge(BMP_STATS* into, const BMP_STATS* from);
+
+typedef struct {
+    BMP_DECODE_OPTIONS options;
+    const BMP_ALLOCATOR* allocator;     // NULL for malloc
+    BMP_STATUS status;                  // of the last decode
+    int error;                          // errno value behind status, 0 on success
+    UNSERIAL_BITMAP hdr;                // ->file, ->info and ->palette of the last image
+    BMP_REGION region;                  // part of it that was decoded
+    BMP_IMAGE image;
+    RGBQUAD palette[256];
+    BMP_CONVERTER converter;
+    BMP_DECODER_BUFFER scratch;         // raw rows / RLE stream
+    BMP_DECODER_BUFFER pixels;          // output
+    BMP_DECODER_BUFFER columns;         // realigned row, for 1 / 2 / 4bpp regions off a byte boundary
+    BMP_DECODER_BUFFER scaler;          // row sums and accumulators of scaled decodes
+    size_t reserved;                    // buffer bytes the current image needs, against max_bytes
+    BMP_STATS stats;                    // totals since init; clear it to start over
+    uint64_t stage_start;               // instrumentation: when the current stage began
+} BMP_DECODER;
+
+// options may be NULL for RGBA8, top-down, no limits
+bool bmp_decoder_init(BMP_DECODER* dec, const BMP_DECODE_OPTIONS* options, const BMP_ALLOCATOR* allocator);
+void bmp_decoder_destroy(BMP_DECODER* dec);
+// All return false with dec->status / dec->error (and errno) set on failure
+bool bmp_decoder_decode(BMP_DECODER* dec, FILE* bmp_read, BMP_IMAGE* out);
+bool bmp_decoder_decode_path(BMP_DECODER* dec, const char* path, BMP_IMAGE* out);
+bool bmp_decoder_decode_memory(BMP_DECODER* dec, const void* data, size_t cb, BMP_IMAGE* out);
+// Decodes only region (NULL for all) of the image. Uncompressed rows outside it are never
+//  read: narrow regions pread just their columns of each row, wide ones whole rows in bands.
+//  RLE streams are decoded up to the region's top row and no further. max_width /
+//  max_height apply to the region, so tiles can be cut out of images larger than that.
+bool bmp_decoder_decode_region(BMP_DECODER* dec, int fd, const BMP_REGION* region, BMP_IMAGE* out);
+bool bmp_decoder_decode_region_memory(BMP_DECODER* dec, const void* data, size_t cb, const BMP_REGION* region, BMP_IMAGE* out);
+// Thumbnail decode: the image shrunk to width x height (either may be 0 to keep the aspect
+//  ratio) by area averaging, accumulated as rows stream in so the full resolution image
+//  never exists in memory. When both sides shrink by the same integer factor (e.g. Width / 2,
+//  / 4, / 8) this is an exact box filter with vectorized horizontal sums. Sources with alpha
+//  are averaged premultiplied, so fully transparent pixels contribute no color. Downscaling only.
+bool bmp_decoder_decode_scaled(BMP_DECODER* dec, FILE* bmp_read, uint32_t width, uint32_t height, BMP_IMAGE* out);
+bool bmp_decoder_decode_scaled_memory(BMP_DECODER* dec, const void* data, size_t cb, uint32_t width, uint32_t height, BMP_IMAGE* out);
+
+
+// Batch decode: many bitmaps through one pipeline that overlaps reading with decoding.
+//  A source is a path, or data / size when path is NULL.
+typedef struct {
+    const char* path;
+    const void* data;
+    size_t size;
+} BMP_BATCH_SOURCE;
+
+typedef struct {
+    BMP_DECODE_OPTIONS options;         // for every image
+    unsigned workers;                   // decode threads, 0 = one per online cpu
+    unsigned depth;                     // files read ahead of the decoders, 0 = 32
+    bool pread_only;                    // skip io_uring where it is available
+    BMP_STATS* stats;                   // when not NULL, the batch's decoders and reads are
+                                        //  added to it
+} BMP_BATCH_OPTIONS;
+
+// Called once per source, on a decode thread, in completion order. image is NULL when
+//  the source failed (status says why); otherwise it and its pixels are only valid until
+//  the callback returns.
+typedef void (*BMP_BATCH_CALLBACK)(void* user, size_t index, BMP_STATUS status, const BMP_IMAGE* image);
+
+// On Linux files are read through an io_uring ring by one I/O thread: the first 54 bytes,
+//  then exactly the rest of the image as BlobIndex and the header give it, while workers
+//  decode what has arrived. Elsewhere, or when the ring cannot be set up, each worker reads
+//  its files with pread. options may be NULL for RGBA8, top-down. Returns the number of
+//  images decoded.
+size_t bmp_decode_batch(const BMP_BATCH_SOURCE* sources, size_t count, const BMP_BATCH_OPTIONS* options,
+    const BMP_ALLOCATOR* allocator, BMP_BATCH_CALLBACK callback, void* user);
+
+// Releases what in owns: a heap blob, the file mapping, the palette. A borrowed blob is
+//  left to its owner, or goes with the mapping.
+void free_bmp(UNSERIAL_BITMAP* in);
+
+// Unpadded and padded (DWORD aligned, as on disk) bytes per row
+size_t bmp_row_bytes(const UNSERIAL_BITMAP* in);
+size_t bmp_row_stride(const UNSERIAL_BITMAP* in);
+
+// ===                              ===
+// ===           Writing            ===
+// ===                              ===
+//  Serializes in (->info.bmp3 size / depth / compression, ->palette, ->blob rows in file
+//  order, ->stride apart) with an info header of hdrsize bytes:
+//  CB_SERIALIZED_BITMAPV3INFOHEADER or CB_SERIALIZED_BITMAPV5INFOHEADER.
+//  Headers and color table go out as one buffer, pixel rows with their padding through
+//  writev, or a single write when blob is already laid out as on disk. RLE8 / RLE4
+//  images (blob holding indices, as parse_bmp leaves them) are encoded again. A parsed
+//  .DDB goes out as a top-down BMP, its rows DWORD aligned and the color table the one
+//  bmp_palette_init stands in for it.
+bool write_bmp(int fd, const UNSERIAL_BITMAP* in, uint32_t hdrsize);
+// write_bmp, but uncompressed bottom-up 8 / 4bpp images go out RLE8 / RLE4 when that
+//  comes out smaller than the raw pixel array
+bool write_bmp_compressed(int fd, const UNSERIAL_BITMAP* in, uint32_t hdrsize);
+bool write_bmp_path(const char* path, const UNSERIAL_BITMAP* in, uint32_t hdrsize);
+
+// ===                              ===
+// ===            Packs             ===
+// ===                              ===
+//  Many bitmaps in one file behind an index built when the pack is written, so a set of
+//  assets loads with one open and one mapping instead of an open / read / close per file.
+//  Layout, little endian: a 16 byte header ("BMPK", version, entry count, 0), the index of
+//  32 byte entries, then every bitmap file byte for byte, each placed so its pixel array
+//  starts 16 byte aligned. Entries are numbered in the order they were written.
+#define BMP_PACK_MAGIC 0x4B504D42U      // "BMPK"
+#define BMP_PACK_VERSION 1U
+#define CB_SERIALIZED_BMP_PACK_HEADER 16
+#define CB_SERIALIZED_BMP_PACK_ENTRY 32
+
+typedef struct {
+    uint64_t offset;            // of the bitmap file, from the start of the pack
+    uint32_t size;              // bytes of it
+    uint32_t pixels;            // its pixel array, from offset (the file's BlobIndex)
+    int32_t width;              // as ->info.bmp3 has them: negative height for top-down
+    int32_t height;
+    uint16_t bit_count;
+    uint16_t header_size;       // ->info.hdrsize
+    uint32_t compression;
+} BMP_PACK_ENTRY;
+
+typedef struct {
+    const unsigned char* base;  // read only mapping of the whole pack
+    size_t size;
+    size_t count;
+    BMP_PACK_ENTRY* entries;    // the index, checked against size when the pack was opened
+    const BMP_ALLOCATOR* allocator;
+} BMP_PACK;
+
+// Writes count sources (paths, or bitmap files in memory) to fd as a pack, from offset 0
+//  (fd is truncated first). Every file must parse; otherwise the pack is incomplete,
+//  *failed (may be NULL) names the source that stopped it, count when the index itself
+//  could not be written.
+bool bmp_pack_write(int fd, const BMP_BATCH_SOURCE* sources, size_t count, size_t* failed);
+// Maps path and unpacks its index (with allocator, NULL for malloc); nothing else is read
+//  until an entry is used. The pages are asked for up front with POSIX_MADV_WILLNEED.
+bool bmp_pack_open(BMP_PACK* pack, const char* path, const BMP_ALLOCATOR* allocator);
+void bmp_pack_close(BMP_PACK* pack);
+// Entry id's bitmap file as a view into the mapping, for parse_bmp_memory or any of the
+//  decoder's _memory calls. Uncompressed rows can also be taken straight from
+//  base + offset + pixels. NULL with errno ENOENT past the last entry.
+const void* bmp_pack_data(const BMP_PACK* pack, size_t id, size_t* size);
+// bmp_decoder_decode_memory of entry id
+bool bmp_pack_decode(BMP_DECODER* dec, const BMP_PACK* pack, size_t id, BMP_IMAGE* out);
+
+// ===                              ===
+// ===       Terminal preview       ===
+// ===                              ===
+//  Draws in (as parsed: ->blob rows in file order, ->stride apart) on a 24-bit color
+//  terminal, two pixels per character cell with half blocks (U+2580), area averaged down
+//  to fit columns x rows cells keeping the aspect ratio; 0 takes the size of the terminal
+//  behind fd, 80 x 24 when it is not one. One line is left for the prompt, and
+//  transparency shows as black. Colors are only set where they change along a line; the
+//  whole frame is built in one buffer sized up front and goes out in a single write.
+bool bmp_render_terminal(int fd, const UNSERIAL_BITMAP* in, unsigned columns, unsigned rows);
+// bmp_render_terminal to stdout, after flushing it
+bool blit_console(const UNSERIAL_BITMAP* in);
+
+#endif // BMPLIB_BMP_H
@@ -0,0 +1,490 @@
+// Decoder benchmarks. Build alongside the library without its demo main:
+//
+//  cc -std=c99 -O2 -pthread -DBMPLIB_NO_MAIN bmp.c bmp_bench.c -o bmp_bench
+//
+//  bmp_bench [max_side [filter]]
+//
+// Decodes a synthetic corpus (every header version, bit depth, compression and
+//  orientation, square sizes from 16 up to max_side, 1024 by default and 16384 at most)
+//  and reports throughput, allocations and latency percentiles per case. filter keeps the
+//  cases whose name contains it; without one the RLE decoder is also checked against a
+//  naive reference, and hostile headers are checked to be refused before any allocation.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include "bmp.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift, deterministic corpus across runs
+static uint32_t rng_state = 0x2545F491U;
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void put_u16(unsigned char* p, uint16_t v) {
+    p[0] = (unsigned char)v, p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+    put_u16(p, (uint16_t)v), put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+// ===                              ===
+// ===            RLE               ===
+// ===                              ===
+
+// Naive byte at a time decoder, pixel by pixel with a bounds check on every write
+static void reference_set(unsigned char* dst, size_t stride, unsigned bits, uint32_t x, uint32_t y, unsigned v) {
+    unsigned char* row = dst + y * stride;
+    if (8 == bits)
+        row[x] = (unsigned char)v;
+    else if (x & 1)
+        row[x >> 1] = (unsigned char)((row[x >> 1] & 0xF0) | v);
+    else row[x >> 1] = (unsigned char)((row[x >> 1] & 0x0F) | (v << 4));
+}
+
+static bool reference_decode_rle(const unsigned char* p, size_t cb, uint32_t w, uint32_t h, unsigned bits, unsigned char* dst, size_t stride) {
+
+    const unsigned char* end = p + cb;
+    uint32_t x = 0, y = 0;
+    memset(dst, 0, stride * h);
+    while ((p + 1 < end) && (y < h)) {
+        unsigned n = *p++, v = *p++;
+        if (n) {
+            for (unsigned i = 0; i < n; ++i, ++x) {
+                if (x >= w)
+                    return false;
+                reference_set(dst, stride, bits, x, y, (8 == bits) ? v : ((i & 1) ? (v & 0x0F) : (v >> 4)));
+            }
+        }
+        else if (0 == v)
+            x = 0, ++y;
+        else if (1 == v)
+            break;
+        else if (2 == v) {
+            if (p + 1 >= end)
+                return false;
+            x += *p++;
+            y += *p++;
+            if ((x > w) || (y > h))
+                return false;
+        }
+        else {
+            for (unsigned i = 0; i < v; ++i, ++x) {
+                unsigned byte = (8 == bits) ? i : (i >> 1);
+                if ((x >= w) || (p + byte >= end))
+                    return false;
+                reference_set(dst, stride, bits, x, y, (8 == bits) ? p[i] : ((i & 1) ? (p[byte] & 0x0F) : (p[byte] >> 4)));
+            }
+            size_t cbrun = (8 == bits) ? v : ((v + 1) >> 1);
+            p += cbrun + (cbrun & 1);
+        }
+    }
+    return true;
+}
+
+// Synthetic stream: mostly long encoded runs with absolute runs, deltas and early end of lines mixed in
+static size_t generate_rle(unsigned char* out, uint32_t w, uint32_t h, unsigned bits) {
+
+    unsigned char* o = out;
+    for (uint32_t y = 0; y < h; ++y) {
+        uint32_t x = 0;
+        while (x < w) {
+            uint32_t left = w - x, r = rng() % 16;
+            if (r < 10) {
+                uint32_t n = 1 + rng() % 255;
+                n = (n > left) ? left : n;
+                *o++ = (unsigned char)n;
+                *o++ = (unsigned char)rng();
+                x += n;
+            }
+            else if ((r < 15) && (left >= 3)) {
+                uint32_t n = 3 + rng() % 60;
+                n = (n > left) ? left : n;
+                size_t cbrun = (8 == bits) ? n : ((n + 1) >> 1);
+                *o++ = 0;
+                *o++ = (unsigned char)n;
+                for (size_t i = 0; i < cbrun; ++i)
+                    *o++ = (unsigned char)rng();
+                if (cbrun & 1)
+                    *o++ = 0;
+                x += n;
+            }
+            else if ((r == 15) && (left > 8) && (y + 1 < h)) {
+                // short delta within the row
+                *o++ = 0, *o++ = 2, *o++ = 8, *o++ = 0;
+                x += 8;
+            }
+            else break;
+        }
+        *o++ = 0, *o++ = 0;
+    }
+    *o++ = 0, *o++ = 1;
+    return (size_t)(o - out);
+}
+
+static bool bench_rle(unsigned bits, uint32_t w, uint32_t h, unsigned iterations) {
+
+    UNSERIAL_BITMAP hdr = {0};
+    hdr.info.bmp3.Width = (int32_t)w;
+    hdr.info.bmp3.Height = (int32_t)h;
+    hdr.info.bmp3.BitCount = (uint16_t)bits;
+    hdr.info.bmp3.Compression = (8 == bits) ? BMP_COMPRESSION_RLE8 : BMP_COMPRESSION_RLE4;
+
+    const size_t stride = bmp_row_bytes(&hdr), cbimage = stride * h;
+    // worst case: every pixel pair in an absolute run of 3
+    unsigned char* rle = malloc((size_t)w * h * 2 + h * 2 + 16);
+    unsigned char* fast = malloc(cbimage);
+    unsigned char* naive = malloc(cbimage);
+    if (!rle || !fast || !naive)
+        return false;
+    const size_t cb = generate_rle(rle, w, h, bits);
+
+    bool ok = bmp_decode_rle(rle, cb, &hdr, fast, stride)
+        && reference_decode_rle(rle, cb, w, h, bits, naive, stride)
+        && !memcmp(fast, naive, cbimage);
+    if (!ok) {
+        printf("RLE%u %ux%u: decoders disagree\n", bits, w, h);
+        return false;
+    }
+
+    double t0 = now_seconds();
+    for (unsigned i = 0; i < iterations; ++i)
+        bmp_decode_rle(rle, cb, &hdr, fast, stride);
+    double t1 = now_seconds();
+    for (unsigned i = 0; i < iterations; ++i)
+        reference_decode_rle(rle, cb, w, h, bits, naive, stride);
+    double t2 = now_seconds();
+
+    const double mb = (double)cbimage * iterations / (1024 * 1024);
+    printf("RLE%u %5ux%-5u %8.1f MB/s  naive %8.1f MB/s  (x%.1f)\n",
+        bits, w, h, mb / (t1 - t0), mb / (t2 - t1), (t2 - t1) / (t1 - t0));
+
+    free(rle), free(fast), free(naive);
+    return true;
+}
+
+// ===                              ===
+// ===       Synthetic corpus       ===
+// ===                              ===
+
+typedef struct {
+    const char* name;
+    uint32_t hdrsize;
+} HEADER_KIND;
+
+// v3nt is a 40 byte header with the three masks right after it
+static const HEADER_KIND header_kinds[] = {
+    { "v2", 12 }, { "v3", 40 }, { "v3nt", 40 }, { "v4", 108 }, { "v5", 124 },
+};
+
+typedef struct {
+    const HEADER_KIND* header;
+    unsigned bits;
+    uint32_t compression;
+    bool top_down;
+} CORPUS_CASE;
+
+static const char* compression_name(uint32_t compression) {
+    switch (compression) {
+        case BMP_COMPRESSION_RLE8:      return "rle8";
+        case BMP_COMPRESSION_RLE4:      return "rle4";
+        case BMP_COMPRESSION_BITFIELDS: return "bitfields";
+    }
+    return "none";
+}
+
+// Combinations the format allows: core headers carry no compression, 16 or 32bpp, or
+//  top-down rows; RLE runs bottom-up; masks come with v3nt / v4 / v5 only
+static bool corpus_case_valid(const CORPUS_CASE* c) {
+    const bool core = (12 == c->header->hdrsize), nt = !strcmp(c->header->name, "v3nt");
+    switch (c->compression) {
+        case BMP_COMPRESSION_NONE:
+            return !nt && !(core && ((16 == c->bits) || (32 == c->bits) || c->top_down));
+        case BMP_COMPRESSION_RLE8:
+            return !core && !nt && (8 == c->bits) && !c->top_down;
+        case BMP_COMPRESSION_RLE4:
+            return !core && !nt && (4 == c->bits) && !c->top_down;
+        case BMP_COMPRESSION_BITFIELDS:
+            return !core && strcmp(c->header->name, "v3") && ((16 == c->bits) || (32 == c->bits));
+    }
+    return false;
+}
+
+// A whole file in memory: headers, color table and random pixels (or an RLE stream)
+static unsigned char* generate_bmp(const CORPUS_CASE* c, uint32_t w, uint32_t h, size_t* cbout) {
+
+    const bool core = (12 == c->header->hdrsize), bitfields = (BMP_COMPRESSION_BITFIELDS == c->compression);
+    const size_t colors = (c->bits <= 8) ? (size_t)1 << c->bits : 0,
+                 cbcolors = colors * (core ? 3 : 4),
+                 cbmasks = (bitfields && (40 == c->header->hdrsize)) ? 12 : 0,
+                 offset = 14 + c->header->hdrsize + cbmasks + cbcolors,
+                 stride = ((size_t)w * c->bits + 31) / 32 * 4;
+    const bool rle = (BMP_COMPRESSION_RLE8 == c->compression) || (BMP_COMPRESSION_RLE4 == c->compression);
+    const size_t cbpixels = rle ? (size_t)w * h * 2 + (size_t)h * 2 + 16 : stride * h;
+
+    unsigned char* p = calloc(1, offset + cbpixels);
+    if (!p)
+        return NULL;
+    size_t cbimage = cbpixels;
+    if (rle)
+        cbimage = generate_rle(p + offset, w, h, c->bits);
+    else {
+        uint32_t* words = (uint32_t*)(p + offset);
+        for (size_t i = 0; i < cbpixels / 4; ++i)
+            words[i] = rng();
+    }
+
+    p[0] = 'B', p[1] = 'M';
+    put_u32(p + 2, (uint32_t)(offset + cbimage));
+    put_u32(p + 10, (uint32_t)offset);
+    unsigned char* info = p + 14;
+    put_u32(info, c->header->hdrsize);
+    if (core) {
+        put_u16(info + 4, (uint16_t)w);
+        put_u16(info + 6, (uint16_t)h);
+        put_u16(info + 8, 1);
+        put_u16(info + 10, (uint16_t)c->bits);
+    }
+    else {
+        put_u32(info + 4, w);
+        put_u32(info + 8, c->top_down ? (uint32_t)-(int32_t)h : h);
+        put_u16(info + 12, 1);
+        put_u16(info + 14, (uint16_t)c->bits);
+        put_u32(info + 16, c->compression);
+        put_u32(info + 20, (uint32_t)cbimage);
+        put_u32(info + 32, (uint32_t)colors);
+        if (bitfields || (c->header->hdrsize >= 108)) {
+            // 565 / 8888 masks; v4+ headers always carry them
+            const bool is16 = (16 == c->bits);
+            put_u32(info + 40, is16 ? 0xF800U : 0x00FF0000U);
+            put_u32(info + 44, is16 ? 0x07E0U : 0x0000FF00U);
+            put_u32(info + 48, is16 ? 0x001FU : 0x000000FFU);
+            if (c->header->hdrsize >= 108)
+                put_u32(info + 52, is16 ? 0 : 0xFF000000U);
+        }
+    }
+    unsigned char* table = info + c->header->hdrsize + cbmasks;
+    for (size_t i = 0; i < cbcolors; ++i)
+        table[i] = (unsigned char)rng();
+    if (!core)
+        for (size_t i = 0; i < colors; ++i)
+            table[i * 4 + 3] = 0;
+
+    *cbout = offset + cbimage;
+    return p;
+}
+
+// Counts the decoder's trips to the heap
+static size_t allocations;
+
+static void* counting_alloc(void* user, size_t cb) {
+    ++allocations;
+    return malloc(cb);
+}
+
+static void counting_release(void* user, void* p) {
+    free(p);
+}
+
+static const BMP_ALLOCATOR counting_allocator = { counting_alloc, counting_release, NULL };
+
+static int compare_double(const void* a, const void* b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Timed decodes of one case at one size: at least 3, then until about a quarter second
+//  has gone by (1000 at most). False when the decoder rejects the file.
+#define CASE_SECONDS 0.25
+#define CASE_RUNS_MAX 1000
+
+static bool bench_case(const CORPUS_CASE* c, const char* name, uint32_t side) {
+
+    size_t cb;
+    unsigned char* file = generate_bmp(c, side, side, &cb);
+    if (!file) {
+        printf("%-24s %5ux%-5u  out of memory generating\n", name, side, side);
+        return false;
+    }
+
+    // allocations of a first decode, then of reuse
+    BMP_DECODER dec;
+    BMP_IMAGE image;
+    allocations = 0;
+    bmp_decoder_init(&dec, NULL, &counting_allocator);
+    if (!bmp_decoder_decode_memory(&dec, file, cb, &image)) {
+        printf("%-24s %5ux%-5u  %s\n", name, side, side, bmp_status_string(dec.status));
+        bmp_decoder_destroy(&dec);
+        free(file);
+        return false;
+    }
+    const size_t cold = allocations;
+
+    double* times = malloc(CASE_RUNS_MAX * sizeof(double));
+    size_t runs = 0;
+    double total = 0;
+    allocations = 0;
+    while ((runs < CASE_RUNS_MAX) && ((runs < 3) || (total < CASE_SECONDS))) {
+        const double t0 = now_seconds();
+        bmp_decoder_decode_memory(&dec, file, cb, &image);
+        times[runs] = now_seconds() - t0;
+        total += times[runs++];
+    }
+    qsort(times, runs, sizeof(double), compare_double);
+
+    const double pixels = (double)side * side;
+    printf("%-24s %5ux%-5u %9.1f %9.1f %10.1f %10.1f %6zu %8.2f\n", name, side, side,
+        cb * (double)runs / total / (1024 * 1024), pixels * runs / total / 1e6,
+        times[runs / 2] * 1e6, times[(runs * 99) / 100] * 1e6, cold, (double)allocations / runs);
+
+    free(times);
+    bmp_decoder_destroy(&dec);
+    free(file);
+    return true;
+}
+
+static void bench_corpus(uint32_t max_side, const char* filter) {
+
+    static const unsigned depths[] = { 1, 4, 8, 16, 24, 32 };
+    static const uint32_t compressions[] = {
+        BMP_COMPRESSION_NONE, BMP_COMPRESSION_RLE8, BMP_COMPRESSION_RLE4, BMP_COMPRESSION_BITFIELDS
+    };
+
+    printf("%-24s %11s %9s %9s %10s %10s %6s %8s\n",
+        "case", "size", "MB/s", "Mpx/s", "p50 us", "p99 us", "allocs", "reuse");
+    for (size_t hk = 0; hk < sizeof(header_kinds) / sizeof(*header_kinds); ++hk)
+    for (size_t d = 0; d < sizeof(depths) / sizeof(*depths); ++d)
+    for (size_t k = 0; k < sizeof(compressions) / sizeof(*compressions); ++k)
+    for (int td = 0; td < 2; ++td) {
+        const CORPUS_CASE c = { &header_kinds[hk], depths[d], compressions[k], td };
+        if (!corpus_case_valid(&c))
+            continue;
+        char name[64];
+        snprintf(name, sizeof(name), "%s %ubpp %s %s", c.header->name, c.bits,
+            compression_name(c.compression), c.top_down ? "td" : "bu");
+        if (filter && !strstr(name, filter))
+            continue;
+        // core headers hold 16 bit sizes
+        for (uint32_t side = 16; (side <= max_side) && !((12 == c.header->hdrsize) && (side > 0xFFFF)); side *= 4)
+            if (!bench_case(&c, name, side))
+                break;
+    }
+}
+
+// ===                              ===
+// ===        Hostile headers       ===
+// ===                              ===
+
+// One header field of a small valid file overwritten
+typedef struct {
+    const char* name;
+    bool rle;               // patches the 16 x 16 RLE8 file, otherwise the 16 x 16 24bpp one
+    size_t offset;          // from the start of the file
+    unsigned cb;            // 2 or 4
+    uint32_t value;
+    bool budgets;           // decode with max_pixels / max_bytes set
+    BMP_STATUS expect;
+} HOSTILE_CASE;
+
+#define HOSTILE_MAX_PIXELS ((uint64_t)1 << 16)
+#define HOSTILE_MAX_BYTES ((size_t)64 << 10)
+
+static const HOSTILE_CASE hostile_cases[] = {
+    { "width 30000, 822 byte file", false, 18, 4, 30000, false, BMP_ERR_IO },
+    { "height 30000",               false, 22, 4, 30000, false, BMP_ERR_IO },
+    { "height 65536",               false, 22, 4, 65536, false, BMP_ERR_IO },
+    { "RLE8 30000 wide, budgets",   true,  18, 4, 30000, true,  BMP_ERR_LIMIT },
+    { "RLE8 30000 high, budgets",   true,  22, 4, 30000, true,  BMP_ERR_LIMIT },
+    { "RLE8 4000 wide, 64KB budget", true, 18, 4, 4000, true,  BMP_ERR_LIMIT },
+    { "negative width",             false, 18, 4, 0xFFFFFFF0U, false, BMP_ERR_HEADER },
+    { "width INT32_MIN",            false, 18, 4, 0x80000000U, false, BMP_ERR_HEADER },
+    { "height INT32_MIN",           false, 22, 4, 0x80000000U, false, BMP_ERR_HEADER },
+    { "width INT32_MAX",            false, 18, 4, 0x7FFFFFFFU, false, BMP_ERR_LIMIT },
+    { "7bpp",                       false, 28, 2, 7, false, BMP_ERR_HEADER },
+    { "0bpp",                       false, 28, 2, 0, false, BMP_ERR_HEADER },
+    { "RLE8 at 24bpp",              false, 30, 4, BMP_COMPRESSION_RLE8, false, BMP_ERR_HEADER },
+    { "RLE4 at 8bpp",               true,  30, 4, BMP_COMPRESSION_RLE4, false, BMP_ERR_HEADER },
+    { "pixels inside the headers",  false, 10, 4, 0, false, BMP_ERR_HEADER },
+    { "pixels past the end",        false, 10, 4, 0xFFFFFFF0U, false, BMP_ERR_IO },
+    { "compression 0xFFFFFFFF",     false, 30, 4, 0xFFFFFFFFU, false, BMP_ERR_UNSUPPORTED },
+};
+
+// Each case must fail with its status having asked the allocator for nothing, so a flood
+//  of them costs workers neither memory nor more than a header's worth of time
+static bool bench_hostile(void) {
+
+    const CORPUS_CASE plain = { &header_kinds[1], 24, BMP_COMPRESSION_NONE, false },
+                      rle = { &header_kinds[1], 8, BMP_COMPRESSION_RLE8, false };
+    size_t cbplain, cbrle;
+    unsigned char* files[2] = { generate_bmp(&plain, 16, 16, &cbplain), generate_bmp(&rle, 16, 16, &cbrle) };
+    if (!files[0] || !files[1])
+        return free(files[0]), free(files[1]), false;
+
+    printf("\n%-28s %-28s %8s\n", "hostile header", "status", "us");
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(hostile_cases) / sizeof(*hostile_cases); ++i) {
+        const HOSTILE_CASE* h = &hostile_cases[i];
+        const size_t cb = h->rle ? cbrle : cbplain;
+        unsigned char* file = malloc(cb);
+        memcpy(file, files[h->rle], cb);
+        if (2 == h->cb)
+            put_u16(file + h->offset, (uint16_t)h->value);
+        else put_u32(file + h->offset, h->value);
+
+        BMP_DECODE_OPTIONS options = { BMP_FORMAT_RGBA8, true, 0, 0, 0, 0 };
+        if (h->budgets)
+            options.max_pixels = HOSTILE_MAX_PIXELS, options.max_bytes = HOSTILE_MAX_BYTES;
+        BMP_DECODER dec;
+        BMP_IMAGE image;
+        bmp_decoder_init(&dec, &options, &counting_allocator);
+        allocations = 0;
+        const double t0 = now_seconds();
+        const bool decoded = bmp_decoder_decode_memory(&dec, file, cb, &image);
+        const double t1 = now_seconds();
+        const bool pass = !decoded && (h->expect == dec.status) && !allocations;
+        printf("%-28s %-28s %8.2f%s\n", h->name, decoded ? "decoded" : bmp_status_string(dec.status),
+            (t1 - t0) * 1e6, pass ? "" : (allocations ? "  ALLOCATED" : "  WRONG STATUS"));
+        ok &= pass;
+        bmp_decoder_destroy(&dec);
+        free(file);
+    }
+    free(files[0]), free(files[1]);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+
+    uint32_t max_side = (argc > 1) ? (uint32_t)atoi(argv[1]) : 1024;
+    const char* filter = (argc > 2) ? argv[2] : NULL;
+    max_side = (max_side < 16) ? 16 : (max_side > 16384) ? 16384 : max_side;
+    bench_corpus(max_side, filter);
+    if (filter)
+        return 0;
+
+    const unsigned iterations = 20;
+    static const uint32_t sizes[][2] = { { 64, 64 }, { 333, 77 }, { 640, 480 }, { 1920, 1080 }, { 4096, 4096 } };
+
+    printf("\n");
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+        ok &= bench_rle(8, sizes[i][0], sizes[i][1], iterations);
+        ok &= bench_rle(4, sizes[i][0], sizes[i][1], iterations);
+    }
+    ok &= bench_hostile();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+// libFuzzer harness for the parsers and the decoder. Build alongside the library without
+//  its demo main, with a pixel ceiling the fuzzer's memory limit can afford:
+//
+//  clang -g -O1 -fsanitize=fuzzer,address,undefined -DBMPLIB_NO_MAIN -DBMP_MAX_PIXELS=16777216 bmp.c bmp_fuzz.c -o bmp_fuzz
+//  bmp_fuzz -max_len=65536 corpus/
+//
+// Every input goes through the header probe, the in memory and FILE parsers (with
+//  budgets), the scanline iterator, and a decoder with budgets: whole image, a region
+//  picked by the input's last bytes, and a thumbnail. Palette images that parse are RLE
+//  encoded again. Refusals are fine; reads out of bounds, leaks, arithmetic overflow and
+//  allocations past the budgets are what the sanitizers are for. ie.bmp is a good seed.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include "bmp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_MAX_PIXELS ((uint64_t)1 << 22)
+#define FUZZ_MAX_BYTES ((size_t)64 << 20)
+
+// 8 and 4bpp images go back through the RLE encoder, into a buffer of the bound
+static void fuzz_encoder(const UNSERIAL_BITMAP* bmp) {
+
+    const uint32_t compression = (8 == bmp->info.bmp3.BitCount) ? BMP_COMPRESSION_RLE8 : BMP_COMPRESSION_RLE4;
+    const size_t bound = bmp_rle_bound(bmp);
+    void* dst;
+    size_t written;
+    if (((8 == bmp->info.bmp3.BitCount) || (4 == bmp->info.bmp3.BitCount)) && bound && (bound <= FUZZ_MAX_BYTES) && (dst = malloc(bound))) {
+        bmp_encode_rle(bmp, compression, dst, bound, &written);
+        free(dst);
+    }
+}
+
+static void fuzz_file(const uint8_t* data, size_t size) {
+
+    FILE* f = fmemopen((void*)data, size, "rb");
+    if (!f)
+        return;
+
+    UNSERIAL_BITMAP bmp = {0};
+    if (probe_bmp(f, &bmp)) {
+        bmp.max_pixels = FUZZ_MAX_PIXELS, bmp.max_bytes = FUZZ_MAX_BYTES;
+        if (parse_bmp(f, &bmp))
+            free_bmp(&bmp);
+    }
+
+    BMP_ROW_READER reader;
+    rewind(f);
+    if (bmp_rows_open(&reader, f, 16)) {
+        const unsigned char* rows[16];
+        while (bmp_rows_next(&reader, 16, rows))
+            ;
+        bmp_rows_close(&reader);
+    }
+    fclose(f);
+}
+
+static void fuzz_decoder(const uint8_t* data, size_t size) {
+
+    const BMP_DECODE_OPTIONS options = {
+        .format = (size ? data[size - 1] : 0) % (BMP_FORMAT_BGRA8_PREMULTIPLIED + 1),
+        .top_down = size && (data[size - 1] & 0x80),
+        .max_pixels = FUZZ_MAX_PIXELS,
+        .max_bytes = FUZZ_MAX_BYTES,
+    };
+    BMP_DECODER dec;
+    BMP_IMAGE image;
+    if (!bmp_decoder_init(&dec, &options, NULL))
+        return;
+
+    if (bmp_decoder_decode_memory(&dec, data, size, &image)) {
+        // a window and a thumbnail of whatever decoded, picked by the input's last bytes
+        //  (a file that decodes is well over 4 bytes long)
+        const uint8_t* tail = data + size - 4;
+        BMP_REGION r;
+        r.x = tail[0] % image.width;
+        r.y = tail[1] % image.height;
+        r.width = 1 + tail[2] % (image.width - r.x);
+        r.height = 1 + tail[3] % (image.height - r.y);
+        const uint32_t thumbnail = (image.width + 3) / 4;
+        bmp_decoder_decode_region_memory(&dec, data, size, &r, &image);
+        bmp_decoder_decode_scaled_memory(&dec, data, size, thumbnail, 0, &image);
+    }
+    bmp_decoder_destroy(&dec);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+
+    UNSERIAL_BITMAP bmp = { .max_pixels = FUZZ_MAX_PIXELS, .max_bytes = FUZZ_MAX_BYTES };
+    if (parse_bmp_memory(data, size, &bmp)) {
+        fuzz_encoder(&bmp);
+        free_bmp(&bmp);
+    }
+
+    fuzz_file(data, size);
+    fuzz_decoder(data, size);
+    return 0;
+}
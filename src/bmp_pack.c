@@ -0,0 +1,159 @@
+// Pack tool: many bitmaps in one indexed file (see Packs in bmp.h). Build alongside the
+//  library without its demo main:
+//
+//  cc -std=c99 -O2 -pthread -DBMPLIB_NO_MAIN bmp.c bmp_pack.c -o bmp_pack
+//
+//  bmp_pack create out.pack a.bmp [b.bmp ...]    prints the id given to each file
+//  bmp_pack list in.pack                         prints the index
+//  bmp_pack extract in.pack id out.bmp           writes an entry back out as a file
+//  bmp_pack decode in.pack [a.bmp ...]           decodes every entry and reports the time,
+//                                                 then the same for the loose files if given
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include "bmp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char* compression_name(uint32_t compression) {
+    switch (compression) {
+        case BMP_COMPRESSION_NONE: return "none";
+        case BMP_COMPRESSION_RLE8: return "rle8";
+        case BMP_COMPRESSION_RLE4: return "rle4";
+        case BMP_COMPRESSION_BITFIELDS: return "bitfields";
+    }
+    return "?";
+}
+
+static int pack_create(const char* path, char** files, size_t count) {
+
+    BMP_BATCH_SOURCE* sources = calloc(count ? count : 1, sizeof(BMP_BATCH_SOURCE));
+    if (!sources)
+        return perror("bmp_pack"), 1;
+    for (size_t i = 0; i < count; ++i)
+        sources[i].path = files[i];
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        free(sources);
+        return perror(path), 1;
+    }
+    size_t failed = count;
+    bool ok = bmp_pack_write(fd, sources, count, &failed);
+    const int err = errno;
+    if (close(fd))
+        ok = false;
+    free(sources);
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", (failed < count) ? files[failed] : path, strerror(err));
+        unlink(path);
+        return 1;
+    }
+    for (size_t i = 0; i < count; ++i)
+        printf("%zu\t%s\n", i, files[i]);
+    return 0;
+}
+
+static int pack_list(const BMP_PACK* pack) {
+    printf("%-6s %12s %10s %7s %12s %4s %4s %s\n", "id", "offset", "size", "pixels", "dimensions", "bpp", "hdr", "compression");
+    for (size_t i = 0; i < pack->count; ++i) {
+        const BMP_PACK_ENTRY* e = &pack->entries[i];
+        char dims[32];
+        snprintf(dims, sizeof(dims), "%dx%d", e->width, e->height);
+        printf("%-6zu %12llu %10u %7u %12s %4u %4u %s\n", i, (unsigned long long)e->offset, e->size, e->pixels,
+            dims, e->bit_count, e->header_size, compression_name(e->compression));
+    }
+    return 0;
+}
+
+static int pack_extract(const BMP_PACK* pack, const char* id, const char* path) {
+
+    size_t cb;
+    const void* data = bmp_pack_data(pack, strtoul(id, NULL, 10), &cb);
+    if (!data)
+        return fprintf(stderr, "%s: no such entry\n", id), 1;
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return perror(path), 1;
+    const bool ok = (cb == fwrite(data, 1, cb, f));
+    if (fclose(f) || !ok)
+        return perror(path), 1;
+    return 0;
+}
+
+static int pack_decode(const BMP_PACK* pack, char** files, size_t count) {
+
+    BMP_DECODER dec;
+    if (!bmp_decoder_init(&dec, NULL, NULL))
+        return perror("bmp_pack"), 1;
+
+    size_t decoded = 0;
+    uint64_t pixels = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < pack->count; ++i) {
+        BMP_IMAGE image;
+        if (bmp_pack_decode(&dec, pack, i, &image))
+            ++decoded, pixels += (uint64_t)image.width * image.height;
+        else fprintf(stderr, "entry %zu: %s\n", i, bmp_status_string(dec.status));
+    }
+    double seconds = now_seconds() - start;
+    printf("pack   %zu of %zu decoded, %.1f Mpx in %.3f ms (%.1f us per image)\n", decoded, pack->count,
+        pixels / 1e6, seconds * 1e3, pack->count ? seconds * 1e6 / pack->count : 0.0);
+
+    if (count) {
+        decoded = 0, pixels = 0;
+        start = now_seconds();
+        for (size_t i = 0; i < count; ++i) {
+            BMP_IMAGE image;
+            if (bmp_decoder_decode_path(&dec, files[i], &image))
+                ++decoded, pixels += (uint64_t)image.width * image.height;
+            else fprintf(stderr, "%s: %s\n", files[i], bmp_status_string(dec.status));
+        }
+        seconds = now_seconds() - start;
+        printf("files  %zu of %zu decoded, %.1f Mpx in %.3f ms (%.1f us per image)\n", decoded, count,
+            pixels / 1e6, seconds * 1e3, seconds * 1e6 / count);
+    }
+    bmp_decoder_destroy(&dec);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    if ((argc >= 3) && !strcmp(argv[1], "create"))
+        return pack_create(argv[2], argv + 3, (size_t)(argc - 3));
+
+    const bool list = (3 == argc) && !strcmp(argv[1], "list"),
+               extract = (5 == argc) && !strcmp(argv[1], "extract"),
+               decode = (argc >= 3) && !strcmp(argv[1], "decode");
+    if (!list && !extract && !decode) {
+        fprintf(stderr, "usage: bmp_pack create out.pack a.bmp [b.bmp ...]\n"
+                        "       bmp_pack list in.pack\n"
+                        "       bmp_pack extract in.pack id out.bmp\n"
+                        "       bmp_pack decode in.pack [a.bmp ...]\n");
+        return 2;
+    }
+
+    BMP_PACK pack;
+    if (!bmp_pack_open(&pack, argv[2], NULL))
+        return perror(argv[2]), 1;
+    int status;
+    if (list)
+        status = pack_list(&pack);
+    else if (extract)
+        status = pack_extract(&pack, argv[3], argv[4]);
+    else status = pack_decode(&pack, argv + 3, (size_t)(argc - 3));
+    bmp_pack_close(&pack);
+    return status;
+}